@@ -123,14 +123,12 @@ class BitBoard {
     }
 
     // Flips black and white side of a board.
-
+    // Square s goes to 89 - s, i.e. all 128 bits are reversed and shifted
+    // down by the 38 unused ones.
     void Mirror() {
-        uint8_t s = 128;  // bit size; must be power of 2
-        __uint128_t mask = ~(__uint128_t)0;
-        while ((s >>= 1) > 0) {
-            mask ^= (mask << s);
-            board_ = ((board_ >> s) & mask) | ((board_ << s) & ~mask);
-        }
+        const std::uint64_t low = ReverseBits(board_);
+        const std::uint64_t high = ReverseBits(board_ >> 64);
+        board_ = (__uint128_t)low << 64 | high;
         board_ >>= 38;
     }
 
@@ -187,6 +185,19 @@ class BitBoard {
     }
 
    private:
+    // Reverses order of bits in a 64-bit word: hardware byte swap, then bits
+    // are reversed within every byte.
+    static std::uint64_t ReverseBits(std::uint64_t x) {
+        x = __builtin_bswap64(x);
+        x = ((x >> 4) & 0x0F0F0F0F0F0F0F0FULL) |
+            ((x & 0x0F0F0F0F0F0F0F0FULL) << 4);
+        x = ((x >> 2) & 0x3333333333333333ULL) |
+            ((x & 0x3333333333333333ULL) << 2);
+        x = ((x >> 1) & 0x5555555555555555ULL) |
+            ((x & 0x5555555555555555ULL) << 1);
+        return x;
+    }
+
     __uint128_t board_ = 0;
 };
 
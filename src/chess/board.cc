@@ -20,7 +20,9 @@
 #include <cctype>
 #include <cstdlib>
 #include <cstring>
+#include <random>
 #include <sstream>
+#include <vector>
 
 #include "chess/board.h"
 #include "utils/exception.h"
@@ -32,6 +34,19 @@ using std::string;
 const string ChessBoard::kStartingFen =
     "rnbakabnr/9/1c5c1/p1p1p1p1p/9/9/P1P1P1P1P/1C5C1/9/RNBAKABNR w - - 0 1";
 
+namespace {
+// Zobrist keys, indexed by (piece * 2 + is_theirs) * 90 + square.
+std::vector<std::uint64_t> BuildZobristKeys() {
+    std::vector<std::uint64_t> res(ChessBoard::kPieceTypes * 2 * 90);
+    // Fixed seed, so that hashes are stable between runs.
+    std::mt19937_64 gen(0x2545F4914F6CDD1DULL);
+    for (auto& key : res) key = gen();
+    return res;
+}
+
+const std::vector<std::uint64_t> kZobristKeys = BuildZobristKeys();
+}  // namespace
+
 void ChessBoard::Clear() {
     std::memset(reinterpret_cast<void*>(this), 0, sizeof(ChessBoard));
 }
@@ -49,6 +64,7 @@ void ChessBoard::Mirror() {
     our_king_.Mirror();
     their_king_.Mirror();
     std::swap(our_king_, their_king_);
+    std::swap(hash_, mirror_hash_);
     flipped_ = !flipped_;
 }
 
@@ -67,10 +83,7 @@ static const std::pair<int, int> kKnightMoves[] = {
   
 static const std::pair<int, int> kAdvisorMoves[] = {
 	{1, 1}, {-1, 1}, {1, -1}, {-1, -1}}; 
-  
-// include kCannonDirection
-static const std::pair<int, int> kRookDirections[] = {
-	{1, 0}, {-1, 0}, {0, 1}, {0, -1}}; 
+
   
 // Tables for attack.
 // Each square goes from left to right, from bottom to top:
@@ -236,6 +249,158 @@ static const BitBoard kKnightAttacks[] = {
     (0x000441400000ULL, 0x000000000000ULL), (0x000220A00000ULL, 0x000000000000ULL),
     (0x000110500000ULL, 0x000000000000ULL), (0x000088280000ULL, 0x000000000000ULL),
     (0x000040140000ULL, 0x000000000000ULL), (0x000020080000ULL, 0x000000000000ULL)};
+
+// Sliding attack tables.
+// Rank occupancy is the 9-bit slice of the board containing the square, file
+// occupancy is every 9th bit of the board starting from the square's column
+// gathered into 10 bits. For a slider standing at a given position of a line
+// and a given occupancy of that line, the tables contain which squares of the
+// line it attacks, so that no ray has to be walked square by square.
+struct LineAttacks {
+    // Rook slides, up to and including the first blocker (the cannon screen).
+    std::uint16_t rook = 0;
+    // Cannon captures, i.e. the first blocker behind the screen.
+    std::uint16_t cannon = 0;
+};
+
+// Table is indexed by (position << length) | occupancy.
+std::vector<LineAttacks> BuildLineAttacks(int length) {
+    std::vector<LineAttacks> res(length << length);
+    for (int pos = 0; pos < length; ++pos) {
+        for (int occ = 0; occ < (1 << length); ++occ) {
+            auto& attacks = res[(pos << length) | occ];
+            for (int dir : {-1, 1}) {
+                bool screen = false;
+                for (int i = pos + dir; i >= 0 && i < length; i += dir) {
+                    const bool occupied = occ & (1 << i);
+                    if (!screen) {
+                        attacks.rook |= 1 << i;
+                        screen = occupied;
+                    } else if (occupied) {
+                        attacks.cannon |= 1 << i;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+    return res;
+}
+
+// Spreads 10-bit file mask back onto the first column of the board.
+std::vector<BitBoard> BuildFileSpread() {
+    std::vector<BitBoard> res(1 << 10);
+    for (int mask = 0; mask < (1 << 10); ++mask) {
+        for (int row = 0; row < 10; ++row) {
+            res[mask].set_if(row, 0, mask & (1 << row));
+        }
+    }
+    return res;
+}
+
+const std::vector<LineAttacks> kRankAttacks = BuildLineAttacks(9);
+const std::vector<LineAttacks> kFileAttacks = BuildLineAttacks(10);
+const std::vector<BitBoard> kFileSpread = BuildFileSpread();
+
+int RankOccupancy(const BitBoard& occupied, int row) {
+    return (occupied.as_int() >> (row * 9)) & 0x1FF;
+}
+
+int FileOccupancy(const BitBoard& occupied, int col) {
+    const __uint128_t file = occupied.as_int() >> col;
+#ifdef __BMI2__
+    // Squares of the first column are bits 0, 9, ..., 63 of the lower half
+    // and bits 8 and 17 of the upper half.
+    return _pext_u64(static_cast<std::uint64_t>(file), 0x8040201008040201ULL) |
+           (_pext_u64(static_cast<std::uint64_t>(file >> 64), 0x20100ULL)
+            << 8);
+#else
+    int res = 0;
+    for (int row = 0; row < 10; ++row) {
+        res |= static_cast<int>((file >> (row * 9)) & 1) << row;
+    }
+    return res;
+#endif
+}
+
+// Rook and cannon attacks from a square, given occupancy of the board.
+struct SliderAttacks {
+    BitBoard rook;
+    BitBoard cannon;
+};
+
+SliderAttacks GetSliderAttacks(BoardSquare square, const BitBoard& occupied) {
+    const int row = square.row();
+    const int col = square.col();
+    const auto& rank = kRankAttacks[(col << 9) | RankOccupancy(occupied, row)];
+    const auto& file =
+        kFileAttacks[(row << 10) | FileOccupancy(occupied, col)];
+    return {BitBoard(__uint128_t(rank.rook) << (row * 9)) +
+                BitBoard(kFileSpread[file.rook].as_int() << col),
+            BitBoard(__uint128_t(rank.cannon) << (row * 9)) +
+                BitBoard(kFileSpread[file.cannon].as_int() << col)};
+}
+
+// Squares from which a pawn of theirs attacks a given square. Their pawns move
+// down, and sideways once they crossed the river.
+std::vector<BitBoard> BuildPawnCheckers() {
+    std::vector<BitBoard> res(90);
+    for (int row = 0; row < 10; ++row) {
+        for (int col = 0; col < 9; ++col) {
+            auto& checkers = res[BoardSquare(row, col).as_int()];
+            if (row < 9) checkers.set(row + 1, col);
+            if (row > 4) continue;
+            if (col > 0) checkers.set(row, col - 1);
+            if (col < 8) checkers.set(row, col + 1);
+        }
+    }
+    return res;
+}
+
+// Knight attacks on a square grouped by the leg a knight has to jump over.
+// Legs are the diagonal neighbours of the attacked square, every leg blocks
+// up to two knights.
+struct KnightChecks {
+    BoardSquare leg[4];
+    BitBoard knights[4];
+};
+
+std::vector<KnightChecks> BuildKnightChecks() {
+    std::vector<KnightChecks> res(90);
+    for (int row = 0; row < 10; ++row) {
+        for (int col = 0; col < 9; ++col) {
+            auto& checks = res[BoardSquare(row, col).as_int()];
+            int idx = 0;
+            for (int dr : {-1, 1}) {
+                for (int dc : {-1, 1}) {
+                    const int i = idx++;
+                    if (!BoardSquare::IsValid(row + dr, col + dc)) continue;
+                    checks.leg[i] = BoardSquare(row + dr, col + dc);
+                    if (BoardSquare::IsValid(row + 2 * dr, col + dc)) {
+                        checks.knights[i].set(row + 2 * dr, col + dc);
+                    }
+                    if (BoardSquare::IsValid(row + dr, col + 2 * dc)) {
+                        checks.knights[i].set(row + dr, col + 2 * dc);
+                    }
+                }
+            }
+        }
+    }
+    return res;
+}
+
+// Squares of their palace, the only ones their king can move to.
+BitBoard BuildTheirPalace() {
+    BitBoard res;
+    for (int row = 7; row < 10; ++row) {
+        for (int col = 3; col < 6; ++col) res.set(row, col);
+    }
+    return res;
+}
+
+const std::vector<BitBoard> kPawnCheckers = BuildPawnCheckers();
+const std::vector<KnightChecks> kKnightChecks = BuildKnightChecks();
+const BitBoard kTheirPalace = BuildTheirPalace();
 }  // namespace
 
 MoveList ChessBoard::GeneratePseudolegalMoves() const {
@@ -243,26 +408,16 @@ MoveList ChessBoard::GeneratePseudolegalMoves() const {
     // King
     for (const auto destination : kKingPos.find(our_king_.as_int()).second) {
         if (our_pieces_.get(destination)) continue;
-        if (IsUnderAttack(destination)) continue;
         result.emplace_back(our_king_, destination);
     }
     // Other pieces
     for (auto source : our_pieces_ - our_king_) {
         // Rook
         if (rooks_.get(source)) {
-            processed_piece = true;
-            for (const auto& direction : kRookDirections) {
-                auto dst_row = source.row();
-                auto dst_col = source.col();
-                while (true) {
-                    dst_row += direction.first;
-                    dst_col += direction.second;
-                    if (!BoardSquare::IsValid(dst_row, dst_col)) break;
-                    const BoardSquare destination(dst_row, dst_col);
-                    if (our_pieces_.get(destination)) break;
-                    result.emplace_back(source, destination);
-                    if (their_pieces_.get(destination)) break;
-                }
+            const auto attacks =
+                GetSliderAttacks(source, our_pieces_ + their_pieces_);
+            for (const auto destination : attacks.rook - our_pieces_) {
+                result.emplace_back(source, destination);
             }
             continue;
         }
@@ -295,24 +450,13 @@ MoveList ChessBoard::GeneratePseudolegalMoves() const {
             continue;
         }
         // Cannon
-        if (cannons_.get(source)){
-            for (const auto& direction : kRookDirections) {
-                auto dst_row = source.row();
-                auto dst_col = source.col();
-                int count_block = 0;
-                while (true) {
-                    dst_row += direction.first;
-                    dst_col += direction.second;
-                    if (!BoardSquare::IsValid(dst_row, dst_col)) break;
-                    const BoardSquare destination(dst_row, dst_col);
-                    if (our_pieces_.get(destination) || their_pieces_.get(destination)) count_block++;
-                    if (count_block == 1) continue;
-                    if (count_block == 2) {
-                        if(!their_pieces_.get(destination)) break;
-                    }
-                    result.emplace_back(source, destination);
-                    if (count_block == 2) break;
-                }
+        if (cannons_.get(source)) {
+            const BitBoard occupied = our_pieces_ + their_pieces_;
+            const auto attacks = GetSliderAttacks(source, occupied);
+            // Quiet moves slide like a rook, captures jump over the screen.
+            for (const auto destination :
+                 (attacks.rook - occupied) + attacks.cannon * their_pieces_) {
+                result.emplace_back(source, destination);
             }
             continue;
         }
@@ -330,29 +474,32 @@ MoveList ChessBoard::GeneratePseudolegalMoves() const {
 bool ChessBoard::ApplyMove(Move move) {
     const auto& from = move.from();
     const auto& to = move.to();
-    const auto from_row = from.row();
-    const auto from_col = from.col();
-    const auto to_row = to.row();
-    const auto to_col = to.col();
+
+    // Remove captured piece.
+    bool reset_60_moves = their_pieces_.get(to);
+    if (reset_60_moves) {
+        UpdateHash(GetPieceAt(to), false, to);
+        their_pieces_.reset(to);
+        rooks_.reset(to);
+        knights_.reset(to);
+        cannons_.reset(to);
+        bishops_.reset(to);
+        advisors_.reset(to);
+        pawns_.reset(to);
+    }
 
     // Move in our pieces.
+    const int piece = GetPieceAt(from);
+    UpdateHash(piece, true, from);
+    UpdateHash(piece, true, to);
     our_pieces_.reset(from);
     our_pieces_.set(to);
 
-    // Remove captured piece
-    bool reset_60_moves = their_pieces_.get(to);
-    their_pieces_.reset(to);
-    rooks_.reset(to);
-    knights_.reset(to);
-    cannons_.reset(to);
-    bishops_.reset(to);
-    advisors_.reset(to);
-    pawns_.reset(to);
-        
-    return reset_60_moves;
-
-    // Now destination square for our piece is known.
-    our_pieces_.set(to);
+    // King move.
+    if (from == our_king_) {
+        our_king_ = to;
+        return reset_60_moves;
+    }
 
     // Ordinary move.
     rooks_.set_if(to, rooks_.get(from));
@@ -371,100 +518,68 @@ bool ChessBoard::ApplyMove(Move move) {
     return reset_60_moves;
 }
 
-bool ChessBoard::IsUnderAttack(BoardSquare square) const {
-    const int row = square.row();
-    const int col = square.col();
-    // Check their pieces that can attack this square:
-    // Check king (king can attack the other king in different way)
-    if (our_king_.get(square)) {
-	      const int krow = their_king_.row();
-        const int kcol = their_king_.col();
-        if (col == kcol) {
-            bool face = true;
-            for (int count_row = 0; count_row <= 9 ; count_row++) {
-                const BoardSquare block(count_row, col);
-                if (count_row > row && count_row < krow) {
-                    if(our_pieces_.get(block) || their_pieces_.get(block)) {face = false;}
-                }
-            }
-            if (face == true) return true;
-        }
+int ChessBoard::GetPieceAt(BoardSquare square) const {
+    if (square == our_king_ || square == their_king_) return kKing;
+    if (rooks_.get(square)) return kRook;
+    if (knights_.get(square)) return kKnight;
+    if (bishops_.get(square)) return kBishop;
+    if (advisors_.get(square)) return kAdvisor;
+    if (cannons_.get(square)) return kCannon;
+    return kPawn;
+}
+
+void ChessBoard::UpdateHash(int piece, bool ours, BoardSquare square) {
+    hash_ ^= kZobristKeys[(piece * 2 + !ours) * 90 + square.as_int()];
+    mirror_hash_ ^=
+        kZobristKeys[(piece * 2 + ours) * 90 + 89 - square.as_int()];
+}
+
+void ChessBoard::RecomputeHash() {
+    hash_ = 0;
+    mirror_hash_ = 0;
+    for (auto square : our_pieces_) {
+        UpdateHash(GetPieceAt(square), true, square);
     }
-    else {
-        for (const auto& delta : kKingMoves) {
-            auto dst_row = row + delta.first;
-            auto dst_col = col + delta.second; 
-            const BoardSquare destination(dst_row, dst_col);
-            if (our_pieces_.get(destination)) break;
-            if (their_pieces_get(destination)) {
-                if (their_king_.get(destination)) return true;
-            break;
-            }
-        }
+    for (auto square : their_pieces_) {
+        UpdateHash(GetPieceAt(square), false, square);
     }
-    // Check Rooks
-    for (const auto& direction : kRookDirections) {
-        auto dst_row = row;
-        auto dst_col = col;
-        while (true) {
-            dst_row += direction.first;
-            dst_col += direction.second;
-            if (!BoardSquare::IsValid(dst_row, dst_col)) break;
-            const BoardSquare destination(dst_row, dst_col);
-            if (our_pieces_.get(destination)) break;
-            if (their_pieces_.get(destination)) {
-                if (rooks_.get(destination)) return true;
-                break;
-            }
-        }
+}
+
+BitBoard ChessBoard::GetAttackers(BoardSquare square, const BitBoard& occupied,
+                                  const BitBoard& theirs, bool king) const {
+    const auto sliders = GetSliderAttacks(square, occupied);
+    BitBoard attackers = sliders.rook * rooks_ + sliders.cannon * cannons_ +
+                         kPawnCheckers[square.as_int()] * pawns_;
+    const auto& checks = kKnightChecks[square.as_int()];
+    for (int i = 0; i < 4; ++i) {
+        if (occupied.get(checks.leg[i])) continue;
+        attackers = attackers + checks.knights[i] * knights_;
     }
-    // Check pawns (Pawns can always attack others except king)
-	if (our_king_.get(square)) {
-		for (const auto& delta : kPawnMoves) {
-			auto dst_row = row + delta.first;
-			auto dst_col = col + delta.second; 
-			const BoardSquare destination(dst_row, dst_col);
-			if (our_pieces_.get(destination)) break;
-			if (their_pieces_get(destination)) {
-				if (pawns_.get(destination)) return true;
-				break;
-			}
-		}
-	}
-    // Check knights
-    for (const auto& delta : kKnightMoves) {
-        auto dst_row = row + delta.first;
-        auto dst_col = col + delta.second;
-        if (!BoardSquare::IsValid(dst_row, dst_col)) continue;
-        const BoardSquare destination(dst_row, dst_col);
-        if (knights_.get(destination) && their_pieces_.get(destination)) {
-            const BoardSquare block(dst_row+delta.first/2,dst_col+delta.second/2);
-            if (!our_pieses_.get(block) && !their_pieces_.get(block)) return true
+    if (king) {
+        // Kings can't face each other on an open file.
+        if (their_king_.col() == square.col()) {
+            attackers = attackers + sliders.rook * their_king();
         }
+    } else if (kTheirPalace.get(square) &&
+               std::abs(their_king_.row() - square.row()) +
+                       std::abs(their_king_.col() - square.col()) ==
+                   1) {
+        // Their king only attacks next squares inside its palace.
+        attackers.set(their_king_);
     }
-    // Check Cannons
-    for (const auto& direction : kRookDirections) {
-        auto dst_row = row;
-        auto dst_col = col;
-        int count_block = 0;
-        while (true) {
-            dst_row += direction.first;
-            dst_col += direction.second;
-            if (!BoardSquare::IsValid(dst_row, dst_col)) break;
-            const BoardSquare destination(dst_row, dst_col);
-            if (our_pieces_.get(destination) || their_pieces_.get(destination)) count_block++;
-            if (count_block == 1) continue;
-            if (count_block == 2) {
-                if(Cannons_.get(destination) && their_pieces_.get(destination)) return true;
-            }
-            if (count_block == 2) break;
-    }
-    return false;
+    return attackers * theirs;
+}
+
+bool ChessBoard::IsUnderAttack(BoardSquare square) const {
+    return !GetAttackers(square, our_pieces_ + their_pieces_, their_pieces_,
+                         square == our_king_)
+                .empty();
 }
 
 bool ChessBoard::IsUnderProtect(BoardSquare square) const {
     const int row = square.row();
     const int col = square.col();
+    const auto sliders = GetSliderAttacks(square, our_pieces_ + their_pieces_);
     // Check our pieces that can attack this square:
     // Check king
 	for (const auto& delta : kKingMoves) {
@@ -478,21 +593,7 @@ bool ChessBoard::IsUnderProtect(BoardSquare square) const {
 		}
 	}
     // Check Rooks
-    for (const auto& direction : kRookDirections) {
-        auto dst_row = row;
-        auto dst_col = col;
-        while (true) {
-            dst_row += direction.first;
-            dst_col += direction.second;
-            if (!BoardSquare::IsValid(dst_row, dst_col)) break;
-            const BoardSquare destination(dst_row, dst_col);
-            if (our_pieces_.get(destination)) break;
-            if (our_pieces_.get(destination)) {
-                if (rooks_.get(destination)) return true;
-                break;
-            }
-        }
-    }
+    if (sliders.rook.intersects(rooks_ * our_pieces_)) return true;
     // Check pawns
     for (const auto& delta : kPawnMoves) {
         auto dst_row = row + delta.first;
@@ -516,83 +617,95 @@ bool ChessBoard::IsUnderProtect(BoardSquare square) const {
         }
     }
     // Check Cannons
-    for (const auto& direction : kRookDirections) {
-        auto dst_row = row;
-        auto dst_col = col;
-        int count_block = 0;
-        while (true) {
-            dst_row += direction.first;
-            dst_col += direction.second;
-            if (!BoardSquare::IsValid(dst_row, dst_col)) break;
-            const BoardSquare destination(dst_row, dst_col);
-            if (our_pieces_.get(destination) || their_pieces_.get(destination)) count_block++;
-            if (count_block == 1) continue;
-            if (count_block == 2) {
-                if(Cannons_.get(destination) && our_pieces_.get(destination)) return true;
-            }
-            if (count_block == 2) break;
-    }
+    if (sliders.cannon.intersects(cannons_ * our_pieces_)) return true;
     return false;
 }
 
-bool ChessBoard::CheckOrCatch() {
-	Mirror();
-	for (auto source:our_pieces_) {
-		if (our_king_.get(source)) {
-			if (IsUnderAttack(source)) return true;
-		}
-		if (Rooks.get(source)) {
-			if (IsUnderAttack(source) && !IsUnderProtect(source)) return true;
-		}
-		if (Knights_.get(source)) {
-			if (IsUnderAttack(source) && !IsUnderProtect(source)) return true;
-		}
-		if (cannons_.get(source)) {
-			if (IsUnderAttack(source) && !IsUnderProtect(source)) return true;
-		}
-		if (bishops_.get(source)) {
-			if (IsUnderAttack(source) && !IsUnderProtect(source)) return true;
-		}
-		if (advisors_.get(source)) {
-			if (IsUnderAttack(source) && !IsUnderProtect(source)) return true;
-		}
-		if (pawns_.get(source)) {
-			if (IsUnderAttack(source) && !IsUnderProtect(source)) return true;
-		}
-		return false;
-	}
-	Mirror();
+bool ChessBoard::CheckOrCatch() const {
+    if (IsUnderAttack(our_king_)) return true;
+    for (auto source : our_pieces_ - our_king_) {
+        if (IsUnderAttack(source) && !IsUnderProtect(source)) return true;
+    }
+    return false;
 }
 
 bool ChessBoard::IsLegalMove(Move move) const {
     const auto& from = move.from();
     const auto& to = move.to();
-    
-    // If it's kings move, check that destination
-    // is not under attack.
-    if (from == our_king_) return true;
-
-    ChessBoard board(*this);
-    board.ApplyMove(move);
-    if (board.IsUnderAttack(board.our_king_)) return false;
+
+    // Only occupancy changes, there is no need to apply the move to a copy of
+    // the board.
+    BitBoard occupied = our_pieces_ + their_pieces_;
+    occupied.reset(from);
+    occupied.set(to);
+    const BoardSquare king = from == our_king_ ? to : our_king_;
+    return GetAttackers(king, occupied, their_pieces_ - to, true).empty();
 }
 
 MoveList ChessBoard::GenerateLegalMoves() const {
-    MoveList move_list = GeneratePseudolegalMoves();
-    MoveList result;
-    result.reserve(move_list.size());
-
-    for (Move m : move_list) {
-        if (IsLegalMove(m)) result.emplace_back(m);
+    MoveList result = GeneratePseudolegalMoves();
+    const BitBoard occupied = our_pieces_ + their_pieces_;
+    const BitBoard checkers =
+        GetAttackers(our_king_, occupied, their_pieces_, true);
+
+    // When not in check, a move can only expose the king if it moves a pinned
+    // piece, or if it is put between the king and a cannon as a screen.
+    BitBoard pinned;
+    BitBoard screens;
+    if (checkers.empty()) {
+        const BitBoard their_rooks = rooks_ * their_pieces_ + their_king();
+        const BitBoard their_cannons = cannons_ * their_pieces_;
+        const auto sliders = GetSliderAttacks(our_king_, occupied);
+        // Pieces next to the king on a line, shielding it from a rook, from
+        // the other king or from a cannon behind another screen.
+        for (auto square : sliders.rook * our_pieces_) {
+            const auto behind = GetSliderAttacks(our_king_, occupied - square);
+            if (behind.rook.intersects(their_rooks) ||
+                behind.cannon.intersects(their_cannons)) {
+                pinned.set(square);
+            }
+        }
+        // Second pieces on a line, keeping a cannon behind them from jumping.
+        for (auto square : sliders.cannon * our_pieces_) {
+            if (GetSliderAttacks(our_king_, occupied - square)
+                    .cannon.intersects(their_cannons)) {
+                pinned.set(square);
+            }
+        }
+        // Pieces on the legs of their knights.
+        const auto& checks = kKnightChecks[our_king_.as_int()];
+        for (int i = 0; i < 4; ++i) {
+            if (our_pieces_.get(checks.leg[i]) &&
+                checks.knights[i].intersects(knights_ * their_pieces_)) {
+                pinned.set(checks.leg[i]);
+            }
+        }
+        // Empty squares between the king and a cannon facing it.
+        for (auto square : sliders.rook * their_cannons) {
+            const auto cannon = GetSliderAttacks(square, occupied);
+            screens = screens + sliders.rook * cannon.rook;
+        }
     }
 
+    // Filter out illegal moves in place. Only king moves, evasions and moves
+    // touching pinned pieces or screens need the full check.
+    result.erase(
+        std::remove_if(result.begin(), result.end(),
+                       [&](Move m) {
+                           if (checkers.empty() && m.from() != our_king_ &&
+                               !pinned.get(m.from()) && !screens.get(m.to())) {
+                               return false;
+                           }
+                           return !IsLegalMove(m);
+                       }),
+        result.end());
     return result;
 }
 
 void ChessBoard::SetFromFen(const std::string& fen, int* no_capture_ply,
                             int* moves) {
     Clear();
-    int row = 8;
+    int row = 9;
     int col = 0;
 
     std::istringstream fen_str(fen);
@@ -645,6 +758,7 @@ void ChessBoard::SetFromFen(const std::string& fen, int* no_capture_ply,
         ++col;
     }
 
+    RecomputeHash();
     if (who_to_move == "b" || who_to_move == "B") {
         Mirror();
     }
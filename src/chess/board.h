@@ -33,6 +33,21 @@ struct MoveExecution;
 class ChessBoard {
    public:
     static const std::string kStartingFen;
+    // Must be bumped whenever GenerateLegalMoves() starts to return moves in a
+    // different order, as NN cache files store policy in that order.
+    static const int kMoveOrderVersion = 1;
+
+    // Piece types, as used for hashing.
+    enum PieceType {
+        kKing,
+        kRook,
+        kKnight,
+        kBishop,
+        kAdvisor,
+        kCannon,
+        kPawn,
+        kPieceTypes
+    };
 
     // Sets position from FEN string.
     // If @no_capture_ply and @moves are not nullptr, they are filled with
@@ -55,23 +70,21 @@ class ChessBoard {
     bool ApplyMove(Move move);
     // Checks if the square is under attack from "theirs" (black).
     bool IsUnderAttack(BoardSquare square) const;
-	// Checks if the square is under attack from "ours" (white)
-	bool IsUnderProtect(BoardSquare square) const;
-	// Check if checking or catching in current state
-	bool CheckOrCatch();
+    // Checks if the square is under attack from "ours" (white)
+    bool IsUnderProtect(BoardSquare square) const;
+    // Checks whether "theirs" (black) give check or chase an unprotected piece
+    // of "ours" (white).
+    bool CheckOrCatch() const;
     // Checks whether at least one of the sides has mating material.
     bool HasMatingMaterial() const;
     // Generates legal moves.
     MoveList GenerateLegalMoves() const;
-    // Check whether pseudolegal move is legal.
+    // Check whether pseudolegal move is legal. Doesn't copy the board.
     bool IsLegalMove(Move move) const;
 
-    uint64_t Hash() const {
-        return HashCat({our_pieces_.as_int(), their_pieces_.as_int(),
-                        rooks_.as_int(), knights_.as_int(), bishops_.as_int(),
-                        advisors_.as_int(), cannons_.as_int(), pawns_.as_int(),
-                        our_king_.as_int(), their_king_.as_int(), flipped_});
-    }
+    // Zobrist hash of the position. It's maintained incrementally, so the call
+    // is cheap.
+    uint64_t Hash() const { return HashCat(hash_, flipped_); }
 
     std::string DebugString() const;
 
@@ -90,7 +103,7 @@ class ChessBoard {
     bool flipped() const { return flipped_; }
 
     bool operator==(const ChessBoard& other) const {
-        return (our_pieces_ == other.our_pieces_) &&
+        return (hash_ == other.hash_) && (our_pieces_ == other.our_pieces_) &&
                (their_pieces_ == other.their_pieces_) &&
                (rooks_ == other.rooks_) && (bishops_ == other.bishops_) &&
                (knights_ == other.knights_) && (advisors_ == other.advisors_) &&
@@ -104,6 +117,19 @@ class ChessBoard {
     }
 
    private:
+    // Returns pieces of @theirs attacking @square given the board occupancy
+    // @occupied. If @king is true, the square is treated as our king's one,
+    // i.e. their king attacks it along an open file.
+    BitBoard GetAttackers(BoardSquare square, const BitBoard& occupied,
+                          const BitBoard& theirs, bool king) const;
+    // Returns type of a piece standing on a square. The square must not be
+    // empty.
+    int GetPieceAt(BoardSquare square) const;
+    // Toggles a piece in both hashes.
+    void UpdateHash(int piece, bool ours, BoardSquare square);
+    // Computes both hashes from scratch.
+    void RecomputeHash();
+
     // All white pieces.
     BitBoard our_pieces_;
     // All black pieces.
@@ -123,6 +149,11 @@ class ChessBoard {
     BoardSquare our_king_;
     BoardSquare their_king_;
     bool flipped_ = false;  // aka "Black to move".
+    // Zobrist hash of pieces on the board.
+    std::uint64_t hash_ = 0;
+    // Zobrist hash of pieces on the mirrored board, so that Mirror() doesn't
+    // have to recompute it.
+    std::uint64_t mirror_hash_ = 0;
 };
 
 }  // namespace cczero
\ No newline at end of file
@@ -0,0 +1,109 @@
+/*
+  This file is part of Chinese Chess Zero.
+  Copyright (C) 2018 The CCZero Authors
+
+  Chinese Chess Zero is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Chinese Chess Zero is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Chinese Chess Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <vector>
+
+#include "chess/board.h"
+#include "chess/perft.h"
+
+namespace cczero {
+
+namespace {
+struct PerftCase {
+    const char* fen;
+    // Node counts for depths 1, 2, 3...
+    std::vector<std::uint64_t> nodes;
+};
+
+void CheckPerft(const PerftCase& test, bool bulk) {
+    ChessBoard board;
+    board.SetFromFen(test.fen);
+    for (size_t i = 0; i < test.nodes.size(); ++i) {
+        const int depth = i + 1;
+        EXPECT_EQ(Perft(board, depth, bulk), test.nodes[i])
+            << test.fen << " depth " << depth;
+    }
+}
+}  // namespace
+
+TEST(ChessBoard, PerftStartingPosition) {
+    CheckPerft({ChessBoard::kStartingFen.c_str(), {44, 1920, 79666, 3290240}},
+               true);
+}
+
+TEST(ChessBoard, PerftStartingPositionBlackToMove) {
+    CheckPerft({"rnbakabnr/9/1c5c1/p1p1p1p1p/9/9/P1P1P1P1P/1C5C1/9/RNBAKABNR "
+                "b - - 0 1",
+                {44, 1920, 79666}},
+               true);
+}
+
+// Kings may not face each other on an open file, so a single piece between
+// them is pinned, and a king may not step onto the other king's file.
+TEST(ChessBoard, PerftFlyingGeneral) {
+    CheckPerft({"4k4/9/9/9/9/9/9/9/4A4/4K4 w - - 0 1", {2, 4, 20, 54}}, true);
+    CheckPerft({"3k5/9/9/9/9/9/9/9/9/4K4 w - - 0 1", {2, 3, 6, 14}}, true);
+}
+
+// Middlegames and endgames with checks, pins, cannon screens and kings on
+// one file.
+TEST(ChessBoard, PerftPositions) {
+    const PerftCase kCases[] = {
+        {"r1ba1a3/4kn3/2n1b4/pNp1p1p1p/4c4/6P2/P1P2R2P/1CcC5/9/2BAKAB2 w - - "
+         "0 1",
+         {38, 1128, 43929, 1339047}},
+        {"1cbak4/9/n2a5/2p1p3p/5cp2/2n2N3/6PCP/3AB4/2C6/3A1K1N1 w - - 0 1",
+         {7, 281, 8620, 326201}},
+        {"5a3/3k5/3aR4/9/5r3/5n3/9/3A1A3/5K3/2BC2B2 w - - 0 1",
+         {25, 424, 9850, 202884}},
+        {"CRN1k1b2/3ca4/4ba3/9/2nr5/9/9/4B4/4A4/4KA3 w - - 0 1",
+         {28, 516, 14808, 395483}},
+        {"R1N1k1b2/9/3aba3/9/2nr5/2B6/9/4B4/4A4/4KA3 w - - 0 1",
+         {21, 364, 7626}},
+        {"C1nNk4/9/9/9/9/9/n1pp5/B3C4/9/3A1K3 w - - 0 1",
+         {28, 222, 6241, 64971}},
+        {"4ka3/4a4/9/9/4N4/p8/9/4C3c/7n1/2BK5 w - - 0 1",
+         {23, 345, 8124, 149272}},
+        {"2b1ka3/9/b3N4/4n4/9/9/9/4C4/2p6/2BK5 w - - 0 1",
+         {21, 195, 3883, 48060}},
+        {"1C2ka3/9/C1Nab1n2/p3p3p/6p2/9/P3P3P/3AB4/3p2c2/c1BAK4 w - - 0 1",
+         {30, 830, 22787}},
+        {"CnN1k1b2/c3a4/4ba3/9/2nr5/9/9/4C4/4A4/4KA3 w - - 0 1",
+         {19, 583, 11714}},
+    };
+    for (const auto& test : kCases) CheckPerft(test, true);
+}
+
+// Makes every move down to the leaves, so that ApplyMove() and Mirror() are
+// covered as well.
+TEST(ChessBoard, PerftWithoutBulkCounting) {
+    CheckPerft({"r1ba1a3/4kn3/2n1b4/pNp1p1p1p/4c4/6P2/P1P2R2P/1CcC5/9/2BAKAB2 "
+                "w - - 0 1",
+                {38, 1128, 43929}},
+               false);
+}
+
+}  // namespace cczero
+
+int main(int argc, char** argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
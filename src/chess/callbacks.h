@@ -59,6 +59,8 @@ struct ThinkingInfo {
     int nps = -1;
     // Hash fullness * 1000
     int hashfull = -1;
+    // Memory taken by search trees, in MiB.
+    int tree_memory = -1;
     // Win in centipawns.
     optional<int> score;
     // Best line found. Moves are from perspective of white player.
@@ -105,6 +107,9 @@ struct TournamentInfo {
     // Player1's [win/draw/lose] as [white/black].
     // e.g. results[2][1] is how many times player 1 lost as black.
     int results[3][2] = {{0, 0}, {0, 0}, {0, 0}};
+    // NN cache counters of both players together, as space separated names
+    // and values.
+    std::string cache_stats;
     using Callback = std::function<void(const TournamentInfo&)>;
 };
 
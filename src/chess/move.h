@@ -18,9 +18,12 @@
 
 #pragma once
 
+#include <algorithm>
 #include <cassert>
 #include <cstdint>
+#include <initializer_list>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "chess/bitboard.h"
@@ -71,6 +74,62 @@ class Move {
     uint16_t data_ = 0;
 };
 
-using MoveList = std::vector<Move>;
+// List of moves with fixed capacity, stored inline, so that move generation
+// doesn't touch the heap. Interface mimics a subset of std::vector.
+class MoveList {
+   public:
+    // Upper bound of number of pseudolegal moves in a xiangqi position:
+    // 2 rooks and 2 cannons 17 moves each, 5 pawns 3 moves each, 2 knights 8
+    // moves each, 2 advisors and 2 bishops 4 moves each and 4 king moves sum
+    // up to 119.
+    static constexpr int kCapacity = 128;
+
+    using iterator = Move*;
+    using const_iterator = const Move*;
+
+    MoveList() = default;
+    MoveList(std::initializer_list<Move> moves) {
+        for (auto move : moves) push_back(move);
+    }
+
+    template <typename... Args>
+    void emplace_back(Args&&... args) {
+        assert(size_ < kCapacity);
+        moves_[size_++] = Move(std::forward<Args>(args)...);
+    }
+    void push_back(Move move) {
+        assert(size_ < kCapacity);
+        moves_[size_++] = move;
+    }
+    // Capacity is fixed, nothing to reserve.
+    void reserve(size_t size) const { assert(size <= kCapacity); }
+    void clear() { size_ = 0; }
+    // Removes moves [first, last) shifting the remaining ones.
+    iterator erase(const_iterator first, const_iterator last) {
+        iterator dst = begin() + (first - begin());
+        dst = std::copy(last, cend(), dst);
+        size_ = dst - begin();
+        return begin() + (first - begin());
+    }
+
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    Move& operator[](size_t idx) { return moves_[idx]; }
+    const Move& operator[](size_t idx) const { return moves_[idx]; }
+    Move& back() { return moves_[size_ - 1]; }
+    const Move& back() const { return moves_[size_ - 1]; }
+
+    iterator begin() { return moves_; }
+    iterator end() { return moves_ + size_; }
+    const_iterator begin() const { return moves_; }
+    const_iterator end() const { return moves_ + size_; }
+    const_iterator cbegin() const { return moves_; }
+    const_iterator cend() const { return moves_ + size_; }
+
+   private:
+    Move moves_[kCapacity];
+    std::uint8_t size_ = 0;
+};
 
 }  // namespace cczero
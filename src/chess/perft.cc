@@ -0,0 +1,114 @@
+/*
+  This file is part of Chinese Chess Zero.
+  Copyright (C) 2018 The CCZero Authors
+
+  Chinese Chess Zero is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Chinese Chess Zero is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Chinese Chess Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "chess/perft.h"
+
+namespace cczero {
+
+namespace {
+const char* kFenStr = "Position to start from, in FEN";
+const char* kDepthStr = "Depth to count nodes to";
+const char* kDivideStr = "Show node counts for every root move";
+const char* kBulkStr = "Count last ply moves without making them";
+const char* kThreadsStr = "Number of worker threads";
+
+ChessBoard MakeChild(const ChessBoard& board, Move move) {
+    ChessBoard child(board);
+    child.ApplyMove(move);
+    child.Mirror();
+    return child;
+}
+}  // namespace
+
+std::uint64_t Perft(const ChessBoard& board, int depth, bool bulk) {
+    if (depth == 0) return 1;
+    const MoveList moves = board.GenerateLegalMoves();
+    if (bulk && depth == 1) return moves.size();
+    std::uint64_t nodes = 0;
+    for (const auto move : moves) {
+        nodes += Perft(MakeChild(board, move), depth - 1, bulk);
+    }
+    return nodes;
+}
+
+void PerftLoop::RunLoop() {
+    options_.Add<StringOption>(kFenStr, "fen") = ChessBoard::kStartingFen;
+    options_.Add<IntOption>(kDepthStr, 1, 20, "depth", 'd') = 4;
+    options_.Add<BoolOption>(kDivideStr, "divide") = false;
+    options_.Add<BoolOption>(kBulkStr, "bulk") = true;
+    options_.Add<IntOption>(kThreadsStr, 1, 128, "threads", 't') = 1;
+
+    if (!options_.ProcessAllFlags()) return;
+    const auto& options = options_.GetOptionsDict();
+    const int max_depth = options.Get<int>(kDepthStr);
+    const bool divide = options.Get<bool>(kDivideStr);
+    const bool bulk = options.Get<bool>(kBulkStr);
+    const int threads = options.Get<int>(kThreadsStr);
+
+    ChessBoard board;
+    board.SetFromFen(options.Get<std::string>(kFenStr));
+    const MoveList root_moves = board.GenerateLegalMoves();
+
+    // Every depth is a separate run, so that growth of the node count and of
+    // the speed can be seen.
+    for (int depth = 1; depth <= max_depth; ++depth) {
+        const auto start = std::chrono::steady_clock::now();
+        // Root moves are split between threads.
+        std::vector<std::uint64_t> counts(root_moves.size());
+        std::atomic<size_t> next_move{0};
+        auto worker = [&]() {
+            for (size_t idx = next_move++; idx < root_moves.size();
+                 idx = next_move++) {
+                counts[idx] = Perft(MakeChild(board, root_moves[idx]),
+                                    depth - 1, bulk);
+            }
+        };
+        std::vector<std::thread> workers;
+        for (int i = 1; i < threads; ++i) workers.emplace_back(worker);
+        worker();
+        for (auto& thread : workers) thread.join();
+
+        std::uint64_t nodes = 0;
+        for (const auto count : counts) nodes += count;
+        const std::int64_t time_us =
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start)
+                .count();
+        const std::int64_t nps = time_us ? nodes * 1000000 / time_us : 0;
+        std::cout << "depth " << depth << " nodes " << nodes << " time "
+                  << time_us / 1000 << " nps " << nps << std::endl;
+
+        if (divide && depth == max_depth) {
+            for (size_t idx = 0; idx < root_moves.size(); ++idx) {
+                Move move = root_moves[idx];
+                if (board.flipped()) move.Mirror();
+                std::cout << move.as_string() << ": " << counts[idx]
+                          << std::endl;
+            }
+        }
+    }
+}
+
+}  // namespace cczero
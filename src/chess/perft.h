@@ -0,0 +1,44 @@
+/*
+  This file is part of Chinese Chess Zero.
+  Copyright (C) 2018 The CCZero Authors
+
+  Chinese Chess Zero is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Chinese Chess Zero is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Chinese Chess Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <cstdint>
+
+#include "chess/board.h"
+#include "utils/optionsparser.h"
+
+namespace cczero {
+
+// Counts leaf nodes of the legal move tree of a given depth. If @bulk is true,
+// moves of the last ply are counted without being made.
+std::uint64_t Perft(const ChessBoard& board, int depth, bool bulk = true);
+
+// Perft mode: prints node counts and speed of the move generator for every
+// depth up to a given one. Node counts are checked against known ones in
+// chess/board_test.cc.
+class PerftLoop {
+   public:
+    void RunLoop();
+
+   private:
+    OptionsParser options_;
+};
+
+}  // namespace cczero
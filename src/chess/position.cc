@@ -25,9 +25,8 @@ namespace cczero {
 Position::Position(const Position& parent, Move m)
     : no_capture_ply_(parent.no_capture_ply_ + 1),
       ply_count_(parent.ply_count_ + 1) {
-    them_board_ = parent.us_board_;
-    bool capture = them_board_.ApplyMove(m);
-    us_board_ = them_board_;
+    us_board_ = parent.us_board_;
+    bool capture = us_board_.ApplyMove(m);
     us_board_.Mirror();
     if (capture) no_capture_ply_ = 0;
 }
@@ -35,8 +34,12 @@ Position::Position(const Position& parent, Move m)
 Position::Position(const ChessBoard& board, int no_capture_ply, int game_ply)
     : no_capture_ply_(no_capture_ply), repetitions_(0), ply_count_(game_ply) {
     us_board_ = board;
-    them_board_ = board;
-    them_board_.Mirror();
+}
+
+ChessBoard Position::GetThemBoard() const {
+    ChessBoard board = us_board_;
+    board.Mirror();
+    return board;
 }
 
 uint64_t Position::Hash() const {
@@ -57,53 +60,125 @@ GameResult PositionHistory::ComputeGameResult() const {
     if (Last().GetNoCapturePly() >= 100) return GameResult::DRAW;
     if (Last().GetGamePly() >= 450) return GameResult::DRAW;
     if (Last().GetRepetitions() >= 2) {
-		if (InCatchOrCheckLoop == true) return IsBlackToMove() ? GameResult::BLACK_WON : GameResult::WHITE_WON;
-		if (InCatchOrCheckLoop == false) return GameResult::DRAW;
-	}
+        // The side which perpetually checks or chases loses.
+        if (Last().IsPerpetual()) {
+            return IsBlackToMove() ? GameResult::BLACK_WON
+                                   : GameResult::WHITE_WON;
+        }
+        return GameResult::DRAW;
+    }
 
     return GameResult::UNDECIDED;
 }
 
 void PositionHistory::Reset(const ChessBoard& board, int no_capture_ply,
                             int game_ply) {
-    positions_.clear();
-    positions_.emplace_back(board, no_capture_ply, game_ply);
+    chunks_.clear();
+    length_ = 0;
+    last_seen_.clear();
+    Push(Position(board, no_capture_ply, game_ply));
+    AddLastToRepetitions();
 }
 
 void PositionHistory::Append(Move m) {
-    // TODO(mooskagh) That should be emplace_back(Last(), m), but MSVS STL
-    //                has a bug in implementation of emplace_back, when
-    //                reallocation happens. (it also reallocates Last())
-    positions_.push_back(Position(Last(), m));
-    positions_.back().SetRepetitions(ComputeLastMoveRepetitions());
+    Push(Position(Last(), m));
+    AddLastToRepetitions();
+}
+
+void PositionHistory::Pop() {
+    RemoveLastFromRepetitions();
+    --length_;
+    if (length_ % kChunkSize == 0) {
+        chunks_.pop_back();
+    } else if (chunks_.back().IsUnique()) {
+        chunks_.back()->pop_back();
+    }
+}
+
+PositionHistory::Entry* PositionHistory::GetMutableEntry(int idx) {
+    auto& chunk = chunks_[idx / kChunkSize];
+    if (!chunk.IsUnique()) return nullptr;
+    return &(*chunk)[idx % kChunkSize];
+}
+
+PositionHistory::Entry& PositionHistory::Push(const Position& position) {
+    const int offset = length_ % kChunkSize;
+    if (offset == 0) {
+        chunks_.emplace_back();
+        chunks_.back()->reserve(kChunkSize);
+    } else if (!chunks_.back().IsUnique()) {
+        // Copy on write.
+        ChunkPtr chunk;
+        chunk->reserve(kChunkSize);
+        chunk->insert(chunk->end(), chunks_.back()->begin(),
+                      chunks_.back()->begin() + offset);
+        chunks_.back() = std::move(chunk);
+    } else {
+        // Drop entries left from popping while the chunk was shared.
+        chunks_.back()->erase(chunks_.back()->begin() + offset,
+                              chunks_.back()->end());
+    }
+    chunks_.back()->push_back({position, {}});
+    ++length_;
+    return chunks_.back()->back();
+}
+
+void PositionHistory::AddLastToRepetitions() {
+    const int idx = length_ - 1;
+    auto& last = *GetMutableEntry(idx);
+
+    int previous = -1;
+    auto iter = last_seen_.emplace(last.position.GetBoard().Hash(), idx);
+    if (!iter.second) {
+        previous = iter.first->second;
+        iter.first->second = idx;
+    }
+    last.info = {previous, -1};
+
+    // Positions before the last capture can never repeat. Compare boards too,
+    // in case of hash collision.
+    const int window_start = idx - last.position.GetNoCapturePly();
+    if (previous >= window_start &&
+        GetPositionAt(previous).GetBoard() == last.position.GetBoard()) {
+        last.position.SetRepetitions(1 +
+                                     GetPositionAt(previous).GetRepetitions());
+        last.position.SetPerpetual(IsPerpetualCycle(previous, idx));
+    } else {
+        last.position.SetRepetitions(0);
+        last.position.SetPerpetual(false);
+    }
+}
+
+void PositionHistory::RemoveLastFromRepetitions() {
+    const auto& last = GetEntry(length_ - 1);
+    const int previous = last.info.previous;
+    if (previous >= 0) {
+        last_seen_[last.position.GetBoard().Hash()] = previous;
+    } else {
+        last_seen_.erase(last.position.GetBoard().Hash());
+    }
 }
 
-int PositionHistory::ComputeLastMoveRepetitions() const {
-    const auto& last = positions_.back();
-    // TODO(crem) implement hash/cache based solution.
-    if (last.GetNoCapturePly() < 4) return 0;
-
-    for (int idx = positions_.size() - 3; idx >= 0; idx -= 2) {
-        const auto& pos = positions_[idx];
-        if (pos.GetBoard() == last.GetBoard()) {
-			// To check weather is in catch or check loop
-			for (int ind = idx; ind <= positions_.size() - 3; ind += 2){
-				if (!CheckOrCatch()) {InCatchOrCheckLoop = false; break;}
-				else {InCatchOrCheckLoop = true;}
-			}
-            return 1 + pos.GetRepetitions();
+bool PositionHistory::IsPerpetualCycle(int from, int to) {
+    for (int idx = to; idx > from; idx -= 2) {
+        int check_or_catch = GetEntry(idx).info.check_or_catch;
+        if (check_or_catch < 0) {
+            // Board is from the point of view of the side being checked.
+            check_or_catch = GetPositionAt(idx).GetBoard().CheckOrCatch();
+            // Shared entries are left as is, other histories may read them.
+            auto* entry = GetMutableEntry(idx);
+            if (entry) entry->info.check_or_catch = check_or_catch;
         }
-        if (pos.GetNoCapturePly() < 2) return 0;
+        if (!check_or_catch) return false;
     }
-    return 0;
+    return true;
 }
 
 uint64_t PositionHistory::HashLast(int positions) const {
     uint64_t hash = positions;
-    for (auto iter = positions_.rbegin(), end = positions_.rend(); iter != end;
-         ++iter) {
+    for (int idx = length_ - 1; idx >= 0; --idx) {
         if (!positions--) break;
-        hash = HashCat(hash, iter->Hash());
+        hash = HashCat(hash, GetPositionAt(idx).Hash());
     }
     return HashCat(hash, Last().GetNoCapturePly());
 }
@@ -18,7 +18,12 @@
 
 #pragma once
 
+#include <atomic>
+#include <memory>
 #include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include "chess/board.h"
 
@@ -44,21 +49,25 @@ class Position {
     // set it.
     void SetRepetitions(int repetitions) { repetitions_ = repetitions; }
 
+    // Whether the side which just moved checked or chased on every move since
+    // the previous occurrence of this position.
+    bool IsPerpetual() const { return perpetual_; }
+    void SetPerpetual(bool perpetual) { perpetual_ = perpetual; }
+
     // Number of ply with no captures and pawn moves.
     int GetNoCapturePly() const { return no_capture_ply_; }
 
     // Gets board from the point of view of player to move.
     const ChessBoard& GetBoard() const { return us_board_; }
-    // Gets board from the point of view of opponent.
-    const ChessBoard& GetThemBoard() const { return them_board_; }
+    // Gets board from the point of view of opponent. It's not stored but
+    // mirrored on every call, so prefer GetBoard() where possible.
+    ChessBoard GetThemBoard() const;
 
     std::string DebugString() const;
 
    private:
     // The board from the point of view of the player to move.
     ChessBoard us_board_;
-    // The board from the point of view of opponent.
-    ChessBoard them_board_;
 
     // How many half-moves without capture or pawn move was there.
     int no_capture_ply_ = 0;
@@ -66,10 +75,18 @@ class Position {
     int repetitions_;
     // number of half-moves since beginning of the game.
     int ply_count_ = 0;
+    // Whether repetition of this position is a perpetual check or chase.
+    bool perpetual_ = false;
 };
 
 enum class GameResult { UNDECIDED, WHITE_WON, DRAW, BLACK_WON };
 
+// History of positions of a game.
+// Positions are stored in fixed size chunks which are shared between copies of
+// a history, and copied only when a copy modifies them. That way copying a
+// long game history (e.g. for every search worker) is cheap, and only the
+// chunk where the copies diverge is ever duplicated.
+// Different copies may be used from different threads.
 class PositionHistory {
    public:
     PositionHistory() = default;
@@ -77,21 +94,23 @@ class PositionHistory {
 
     // Returns first position of the game (or fen from which it was
     // initialized).
-    const Position& Starting() const { return positions_.front(); }
+    const Position& Starting() const { return GetPositionAt(0); }
 
     // Returns the latest position of the game.
-    const Position& Last() const { return positions_.back(); }
+    const Position& Last() const { return GetPositionAt(length_ - 1); }
 
     // N-th position of the game, 0-based.
-    const Position& GetPositionAt(int idx) const { return positions_[idx]; }
+    const Position& GetPositionAt(int idx) const {
+        return GetEntry(idx).position;
+    }
 
     // Trims position to a given size.
     void Trim(int size) {
-        positions_.erase(positions_.begin() + size, positions_.end());
+        while (GetLength() > size) Pop();
     }
 
     // Number of positions in history.
-    int GetLength() const { return positions_.size(); }
+    int GetLength() const { return length_; }
 
     // Resets the position to a given state.
     void Reset(const ChessBoard& board, int no_capture_ply, int game_ply);
@@ -100,7 +119,7 @@ class PositionHistory {
     void Append(Move m);
 
     // Pops last move from history.
-    void Pop() { positions_.pop_back(); }
+    void Pop();
 
     // Finds the endgame state (win/lose/draw/nothing) for the last position.
     GameResult ComputeGameResult() const;
@@ -112,9 +131,85 @@ class PositionHistory {
     uint64_t HashLast(int positions) const;
 
    private:
-    int ComputeLastMoveRepetitions() const;
-
-    std::vector<Position> positions_;
+    struct RepetitionInfo {
+        // Index of the previous position with the same hash, or -1.
+        int previous = -1;
+        // Whether the move into this position was a check or a chase. -1 if
+        // it's not computed yet.
+        int check_or_catch = -1;
+    };
+    struct Entry {
+        Position position;
+        RepetitionInfo info;
+    };
+    static constexpr int kChunkSize = 16;
+    using Chunk = std::vector<Entry>;
+
+    // Reference counted pointer to a chunk. Unlike shared_ptr::use_count(),
+    // IsUnique() is an acquire load, so that reads of the chunk by histories
+    // which have dropped it happen before the writes of the remaining owner.
+    class ChunkPtr {
+       public:
+        ChunkPtr() : shared_(new Shared) {}
+        ChunkPtr(const ChunkPtr& other) : shared_(other.shared_) {
+            shared_->refs.fetch_add(1, std::memory_order_relaxed);
+        }
+        ChunkPtr(ChunkPtr&& other) noexcept : shared_(other.shared_) {
+            other.shared_ = nullptr;
+        }
+        ChunkPtr& operator=(ChunkPtr other) noexcept {
+            std::swap(shared_, other.shared_);
+            return *this;
+        }
+        ~ChunkPtr() {
+            if (shared_ &&
+                shared_->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                delete shared_;
+            }
+        }
+
+        // Whether no other history refers to the chunk.
+        bool IsUnique() const {
+            return shared_->refs.load(std::memory_order_acquire) == 1;
+        }
+        Chunk& operator*() const { return shared_->chunk; }
+        Chunk* operator->() const { return &shared_->chunk; }
+
+       private:
+        struct Shared {
+            Chunk chunk;
+            std::atomic<int> refs{1};
+        };
+        Shared* shared_;
+    };
+
+    const Entry& GetEntry(int idx) const {
+        return (*chunks_[idx / kChunkSize])[idx % kChunkSize];
+    }
+    // Returns entry to modify in place, or nullptr if its chunk is shared with
+    // another history.
+    Entry* GetMutableEntry(int idx);
+    // Adds a position to the end, copying the last chunk if it's shared.
+    Entry& Push(const Position& position);
+
+    // Registers the last position in the repetition index and sets its
+    // repetition count.
+    void AddLastToRepetitions();
+    // Removes the last position from the repetition index.
+    void RemoveLastFromRepetitions();
+    // Whether the side which moved into position @to checked or chased on
+    // every move since position @from.
+    bool IsPerpetualCycle(int from, int to);
+
+    // Chunks of kChunkSize entries. Chunks may contain entries past length_,
+    // those are left from Pop() on a shared chunk and are not used.
+    std::vector<ChunkPtr> chunks_;
+    int length_ = 0;
+    // Board hash -> index of its latest occurrence. Spans the whole history,
+    // so that popping any position restores it from RepetitionInfo::previous;
+    // occurrences before the last capture are ignored when counting
+    // repetitions.
+    std::unordered_map<std::uint64_t, int> last_seen_;
 };
 
 }  // namespace cczero
\ No newline at end of file
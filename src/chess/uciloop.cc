@@ -246,6 +246,9 @@ void UciLoop::SendInfo(const ThinkingInfo& info) {
     if (info.nodes >= 0) res += " nodes " + std::to_string(info.nodes);
     if (info.score) res += " score cp " + std::to_string(*info.score);
     if (info.hashfull >= 0) res += " hashfull " + std::to_string(info.hashfull);
+    if (info.tree_memory >= 0) {
+        res += " treememory " + std::to_string(info.tree_memory);
+    }
     if (info.nps >= 0) res += " nps " + std::to_string(info.nps);
 
     if (!info.pv.empty()) {
@@ -37,6 +37,8 @@ const char* kDebugLogStr = "Do debug logging into file";
 const char* kWeightsStr = "Network weights file path";
 const char* kNnBackendStr = "NN backend to use";
 const char* kNnBackendOptionsStr = "NN backend parameters";
+const char* kNnCacheFileStr = "NNCache file";
+const char* kNnCacheFileSizeStr = "NNCache file size";
 const char* kSlowMoverStr = "Scale thinking time";
 const char* kMoveOverheadStr = "Move time overhead in milliseconds";
 const char* kTimeCurvePeak = "Time weight curve peak ply";
@@ -72,6 +74,16 @@ void EngineController::PopulateOptions(OptionsParser* options) {
     options->Add<IntOption>(
         "NNCache size", 0, 999999999, "nncache", '\0',
         std::bind(&EngineController::SetCacheSize, this, _1)) = 200000;
+    options->Add<IntOption>(
+        "NNCache shards", 1, 256, "nncache-shards", '\0',
+        std::bind(&EngineController::SetCacheShards, this, _1)) = 16;
+    options->Add<ChoiceOption>(
+        "NNCache backend", std::vector<std::string>{"lru", "table"},
+        "nncache-backend", '\0',
+        std::bind(&EngineController::SetCacheBackend, this, _1)) = "lru";
+    options->Add<StringOption>(kNnCacheFileStr, "nncache-file");
+    options->Add<IntOption>(kNnCacheFileSizeStr, 1, 999999999,
+                            "nncache-file-size") = 1000000;
 
     const auto backends = NetworkFactory::Get()->GetBackendsList();
     options->Add<ChoiceOption>(kNnBackendStr, backends, "backend") =
@@ -178,6 +190,7 @@ void EngineController::UpdateNetwork() {
         net_path = DiscoveryWeightsFile();
     }
     Weights weights = LoadWeightsFromFile(net_path);
+    network_hash_ = weights.hash;
 
     OptionsDict network_options =
         OptionsDict::FromString(backend_options, &options_);
@@ -185,10 +198,49 @@ void EngineController::UpdateNetwork() {
     network_ = NetworkFactory::Get()->Create(backend, weights, network_options);
 }
 
-void EngineController::SetCacheSize(int size) { cache_.SetCapacity(size); }
+void EngineController::UpdateCacheFile() {
+    SharedLock lock(busy_mutex_);
+    const std::string filename = options_.Get<std::string>(kNnCacheFileStr);
+    const int size = options_.Get<int>(kNnCacheFileSizeStr);
+    if (filename == cache_file_ && size == cache_file_size_ &&
+        network_hash_ == cache_file_network_hash_) {
+        return;
+    }
+
+    cache_file_ = filename;
+    cache_file_size_ = size;
+    cache_file_network_hash_ = network_hash_;
+    // Evaluations of the previous network must not be used if opening fails.
+    cache_.SetFile(nullptr);
+    if (!filename.empty()) {
+        cache_.SetFile(
+            std::make_unique<NNCacheFile>(filename, size, network_hash_));
+    }
+}
+
+void EngineController::SetCacheSize(int size) {
+    SharedLock lock(busy_mutex_);
+    // The table is reallocated, while search may keep its entries pinned.
+    search_.reset();
+    cache_.SetCapacity(size);
+}
+
+void EngineController::SetCacheShards(int shards) {
+    SharedLock lock(busy_mutex_);
+    // Search may keep cache entries pinned.
+    search_.reset();
+    cache_.SetShards(shards);
+}
+
+void EngineController::SetCacheBackend(const std::string& backend) {
+    SharedLock lock(busy_mutex_);
+    search_.reset();
+    cache_.SetUseTable(backend == "table");
+}
 
 void EngineController::EnsureReady() {
     UpdateNetwork();
+    UpdateCacheFile();
     std::unique_lock<RpSharedMutex> lock(busy_mutex_);
 }
 
@@ -198,6 +250,7 @@ void EngineController::NewGame() {
     search_.reset();
     tree_.reset();
     UpdateNetwork();
+    UpdateCacheFile();
 }
 
 void EngineController::SetPosition(const std::string& fen,
@@ -211,6 +264,7 @@ void EngineController::SetPosition(const std::string& fen,
     for (const auto& move : moves_str) moves.emplace_back(move);
     tree_->ResetToPosition(fen, moves);
     UpdateNetwork();
+    UpdateCacheFile();
 }
 
 void EngineController::Go(const GoParams& params) {
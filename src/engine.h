@@ -60,12 +60,16 @@ class EngineController {
     // Must not block.
     void Stop();
     void SetCacheSize(int size);
+    void SetCacheShards(int shards);
+    void SetCacheBackend(const std::string& backend);
 
     SearchLimits PopulateSearchLimits(int ply, bool is_black,
                                       const GoParams& params);
 
    private:
     void UpdateNetwork();
+    // Opens the cache file if it, its size or the network has changed.
+    void UpdateCacheFile();
 
     const OptionsDict& options_;
 
@@ -87,6 +91,12 @@ class EngineController {
     std::string network_path_;
     std::string backend_;
     std::string backend_options_;
+    uint64_t network_hash_ = 0;
+
+    // Settings of the cache file currently open.
+    std::string cache_file_;
+    int cache_file_size_ = 0;
+    uint64_t cache_file_network_hash_ = 0;
 };
 
 class EngineLoop : public UciLoop {
@@ -18,7 +18,9 @@
 
 #include <iostream>
 
+#include "chess/perft.h"
 #include "engine.h"
+#include "neural/cachebench.h"
 #include "selfplay/loop.h"
 #include "utils/commandline.h"
 
@@ -30,11 +32,22 @@ int main(int argc, const char** argv) {
     CommandLine::Init(argc, argv);
     CommandLine::RegisterMode("uci", "(default) Act as UCI engine");
     CommandLine::RegisterMode("selfplay", "Play games with itself");
+    CommandLine::RegisterMode("perft", "Count and time move generation");
+    CommandLine::RegisterMode("cachebench",
+                              "Time NN cache lookups from many threads");
 
     if (CommandLine::ConsumeCommand("selfplay")) {
         // Selfplay mode.
         SelfPlayLoop loop;
         loop.RunLoop();
+    } else if (CommandLine::ConsumeCommand("perft")) {
+        // Move generator benchmark.
+        PerftLoop loop;
+        loop.RunLoop();
+    } else if (CommandLine::ConsumeCommand("cachebench")) {
+        // NN cache contention benchmark.
+        CacheBenchLoop loop;
+        loop.RunLoop();
     } else {
         // Consuming optional "uci" mode.
         CommandLine::ConsumeCommand("uci");
@@ -19,6 +19,7 @@
 #include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <condition_variable>
 #include <cstring>
 #include <iostream>
 #include <sstream>
@@ -31,68 +32,277 @@
 
 namespace cczero {
 
+/////////////////////////////////////////////////////////////////////////
+// Tree memory pool
+/////////////////////////////////////////////////////////////////////////
+
+namespace {
+// Block sizes are multiples of kBlockAlign up to kMaxBlockSize. Larger
+// allocations go directly to the system.
+const size_t kBlockAlign = 16;
+const size_t kMaxBlockSize = 2048;
+const size_t kNumSizeClasses = kMaxBlockSize / kBlockAlign;
+const size_t kSlabSize = 1 << 20;
+// Number of blocks moved between thread cache and shared free lists at once.
+const int kBatchSize = 64;
+
+size_t GetSizeClass(size_t size) {
+    return (size + kBlockAlign - 1) / kBlockAlign - 1;
+}
+
+// Tells node garbage collector that the pool had to grow.
+void OnTreeMemoryGrowth();
+}  // namespace
+
+struct TreeMemoryPool::FreeBlock {
+    FreeBlock* next;
+};
+
+class TreeMemoryPool::ThreadCache {
+   public:
+    // Returns everything to the pool when the thread exits.
+    ~ThreadCache() {
+        for (size_t i = 0; i < kNumSizeClasses; ++i) {
+            if (!heads[i]) continue;
+            FreeBlock* tail = heads[i];
+            while (tail->next) tail = tail->next;
+            TreeMemoryPool::Get().Return(i, heads[i], tail);
+        }
+    }
+
+    FreeBlock* heads[kNumSizeClasses] = {};
+    int counts[kNumSizeClasses] = {};
+};
+
+TreeMemoryPool& TreeMemoryPool::Get() {
+    // Never destroyed, as threads (e.g. GC) may return memory during exit.
+    static TreeMemoryPool* pool = new TreeMemoryPool();
+    return *pool;
+}
+
+TreeMemoryPool::ThreadCache& TreeMemoryPool::GetThreadCache() {
+    thread_local ThreadCache cache;
+    return cache;
+}
+
+void* TreeMemoryPool::Allocate(size_t size) {
+    used_bytes_ += size;
+    if (size == 0 || size > kMaxBlockSize) return ::operator new(size);
+    const size_t size_class = GetSizeClass(size);
+    auto& cache = GetThreadCache();
+    if (!cache.heads[size_class] && Refill(size_class, &cache)) {
+        OnTreeMemoryGrowth();
+    }
+    FreeBlock* block = cache.heads[size_class];
+    cache.heads[size_class] = block->next;
+    --cache.counts[size_class];
+    return block;
+}
+
+void TreeMemoryPool::Free(void* ptr, size_t size) {
+    used_bytes_ -= size;
+    if (size == 0 || size > kMaxBlockSize) {
+        ::operator delete(ptr);
+        return;
+    }
+    const size_t size_class = GetSizeClass(size);
+    auto& cache = GetThreadCache();
+    FreeBlock* block = static_cast<FreeBlock*>(ptr);
+    block->next = cache.heads[size_class];
+    cache.heads[size_class] = block;
+    if (++cache.counts[size_class] < 2 * kBatchSize) return;
+
+    // Too many free blocks cached, give a batch back.
+    FreeBlock* tail = block;
+    for (int i = 1; i < kBatchSize; ++i) tail = tail->next;
+    cache.heads[size_class] = tail->next;
+    cache.counts[size_class] -= kBatchSize;
+    Return(size_class, block, tail);
+}
+
+bool TreeMemoryPool::Refill(size_t size_class, ThreadCache* cache) {
+    Mutex::Lock lock(mutex_);
+    if (free_lists_.empty()) free_lists_.resize(kNumSizeClasses);
+
+    FreeBlock*& free_list = free_lists_[size_class];
+    if (free_list) {
+        // Take a batch from the shared free list.
+        FreeBlock* tail = free_list;
+        int count = 1;
+        for (; count < kBatchSize && tail->next; ++count) tail = tail->next;
+        cache->heads[size_class] = free_list;
+        cache->counts[size_class] = count;
+        free_list = tail->next;
+        tail->next = nullptr;
+        return false;
+    }
+
+    // Cut a batch of new blocks from a slab.
+    const size_t block_size = (size_class + 1) * kBlockAlign;
+    bool grew = false;
+    FreeBlock* head = nullptr;
+    for (int i = 0; i < kBatchSize; ++i) {
+        if (slab_pos_ + block_size > slab_end_) {
+            slabs_.emplace_back(new char[kSlabSize]);
+            slab_pos_ = slabs_.back().get();
+            slab_end_ = slab_pos_ + kSlabSize;
+            reserved_bytes_ += kSlabSize;
+            grew = true;
+        }
+        FreeBlock* block = reinterpret_cast<FreeBlock*>(slab_pos_);
+        slab_pos_ += block_size;
+        block->next = head;
+        head = block;
+    }
+    cache->heads[size_class] = head;
+    cache->counts[size_class] = kBatchSize;
+    return grew;
+}
+
+void TreeMemoryPool::Return(size_t size_class, FreeBlock* head,
+                            FreeBlock* tail) {
+    Mutex::Lock lock(mutex_);
+    if (free_lists_.empty()) free_lists_.resize(kNumSizeClasses);
+    tail->next = free_lists_[size_class];
+    free_lists_[size_class] = head;
+}
+
+TreeMemoryPool::Stats TreeMemoryPool::GetStats() const {
+    Stats stats;
+    stats.reserved_bytes = reserved_bytes_;
+    stats.used_bytes = used_bytes_;
+    return stats;
+}
+
 /////////////////////////////////////////////////////////////////////////
 // Node garbage collector
 /////////////////////////////////////////////////////////////////////////
 
 namespace {
-// Periodicity of garbage collection, milliseconds.
-const int kGCIntervalMs = 100;
+// Number of nodes a GC thread releases before checking whether it can share
+// the rest of its subtree with idle threads.
+const int kGcSplitInterval = 1024;
 
-// Every kGCIntervalMs milliseconds release nodes in a separate GC thread.
+// Releases subtrees in background threads, woken up when there is work.
+// Normally one thread does all the work. When the tree memory pool has to
+// grow while there is garbage, up to threads_ threads split it.
 class NodeGarbageCollector {
    public:
-    NodeGarbageCollector() : gc_thread_([this]() { Worker(); }) {}
+    NodeGarbageCollector() { SetThreads(1); }
 
-    // Takes ownership of a subtree, to dispose it in a separate thread when
-    // it has time.
+    // Takes ownership of a subtree, to dispose it in a separate thread.
     void AddToGcQueue(std::unique_ptr<Node> node) {
         if (!node) return;
         Mutex::Lock lock(gc_mutex_);
-        subtrees_to_gc_.emplace_back(std::move(node));
+        subtrees_to_gc_.push_back(node.release());
+        wakeup_.notify_one();
+    }
+
+    // Starts more threads, if needed.
+    void SetThreads(int threads) {
+        Mutex::Lock lock(gc_mutex_);
+        while (static_cast<int>(gc_threads_.size()) < threads) {
+            gc_threads_.emplace_back([this]() { Worker(); });
+        }
+        threads_ = threads;
+    }
+
+    // Called when the tree memory pool grows. If garbage is still queued, all
+    // threads are put to work.
+    void OnMemoryPressure() {
+        Mutex::Lock lock(gc_mutex_);
+        if (subtrees_to_gc_.empty() && busy_threads_ == 0) return;
+        under_pressure_ = true;
+        wakeup_.notify_all();
     }
 
     ~NodeGarbageCollector() {
-        // Flips stop flag and waits for a worker thread to stop.
-        stop_ = true;
-        gc_thread_.join();
+        // Flips stop flag and waits for worker threads to stop.
+        {
+            Mutex::Lock lock(gc_mutex_);
+            stop_ = true;
+            wakeup_.notify_all();
+        }
+        for (auto& thread : gc_threads_) thread.join();
+        // What was not released yet is released here.
+        for (Node* node : subtrees_to_gc_) delete node;
     }
 
    private:
-    void GarbageCollect() {
-        while (!stop_) {
-            // Node will be released in destructor when mutex is not locked.
-            std::unique_ptr<Node> node_to_gc;
-            {
-                // Lock the mutex and move last subtree from subtrees_to_gc_
-                // into node_to_gc.
-                Mutex::Lock lock(gc_mutex_);
-                if (subtrees_to_gc_.empty()) return;
-                node_to_gc = std::move(subtrees_to_gc_.back());
-                subtrees_to_gc_.pop_back();
+    // Returns how many threads may work at the moment.
+    int AllowedThreads() const REQUIRES(gc_mutex_) {
+        return under_pressure_ ? threads_ : 1;
+    }
+
+    void Worker() {
+        std::vector<Node*> to_release;
+        Mutex::Lock lock(gc_mutex_);
+        while (true) {
+            wakeup_.wait(lock.get_raw(), [this]() REQUIRES(gc_mutex_) {
+                return stop_ || (!subtrees_to_gc_.empty() &&
+                                 busy_threads_ < AllowedThreads());
+            });
+            if (stop_) return;
+            to_release.push_back(subtrees_to_gc_.back());
+            subtrees_to_gc_.pop_back();
+            ++busy_threads_;
+            lock.get_raw().unlock();
+            Release(&to_release);
+            lock.get_raw().lock();
+            --busy_threads_;
+            if (subtrees_to_gc_.empty() && busy_threads_ == 0) {
+                under_pressure_ = false;
             }
         }
     }
 
-    void Worker() {
-        while (!stop_) {
-            std::this_thread::sleep_for(
-                std::chrono::milliseconds(kGCIntervalMs));
-            GarbageCollect();
-        };
+    // Deletes nodes and all their subtrees without recursion.
+    void Release(std::vector<Node*>* to_release) {
+        int released = 0;
+        while (!to_release->empty()) {
+            Node* node = to_release->back();
+            to_release->pop_back();
+            node->TakeChildren(to_release);
+            delete node;
+            if (++released % kGcSplitInterval == 0) ShareWork(to_release);
+        }
     }
 
-    mutable Mutex gc_mutex_;
-    std::vector<std::unique_ptr<Node>> subtrees_to_gc_ GUARDED_BY(gc_mutex_);
+    // Gives half of the pending subtrees to the queue if other threads could
+    // take them.
+    void ShareWork(std::vector<Node*>* to_release) {
+        if (to_release->size() < 2) return;
+        Mutex::Lock lock(gc_mutex_);
+        if (stop_ || !subtrees_to_gc_.empty() ||
+            busy_threads_ >= AllowedThreads()) {
+            return;
+        }
+        const size_t half = to_release->size() / 2;
+        subtrees_to_gc_.insert(subtrees_to_gc_.end(), to_release->end() - half,
+                               to_release->end());
+        to_release->resize(to_release->size() - half);
+        wakeup_.notify_all();
+    }
 
+    Mutex gc_mutex_;
+    std::condition_variable wakeup_;
+    // Owned subtrees waiting to be released.
+    std::vector<Node*> subtrees_to_gc_ GUARDED_BY(gc_mutex_);
+    int threads_ GUARDED_BY(gc_mutex_) = 1;
+    int busy_threads_ GUARDED_BY(gc_mutex_) = 0;
+    bool under_pressure_ GUARDED_BY(gc_mutex_) = false;
     // When true, Worker() should stop and exit.
-    volatile bool stop_ = false;
-    std::thread gc_thread_;
-};  // namespace
+    bool stop_ GUARDED_BY(gc_mutex_) = false;
+    std::vector<std::thread> gc_threads_;
+};
 
 NodeGarbageCollector gNodeGc;
+
+void OnTreeMemoryGrowth() { gNodeGc.OnMemoryPressure(); }
 }  // namespace
 
+void SetNodeGcThreads(int threads) { gNodeGc.SetThreads(threads); }
+
 /////////////////////////////////////////////////////////////////////////
 // Edge
 /////////////////////////////////////////////////////////////////////////
@@ -106,7 +316,7 @@ Move Edge::GetMove(bool as_opponent) const {
 
 std::string Edge::DebugString() const {
     std::ostringstream oss;
-    oss << "Move: " << move_.as_string() << " P:" << p_;
+    oss << "Move: " << move_.as_string() << " P:" << GetP();
     return oss.str();
 }
 
@@ -114,34 +324,68 @@ std::string Edge::DebugString() const {
 // EdgeList
 /////////////////////////////////////////////////////////////////////////
 
-EdgeList::EdgeList(MoveList moves)
-    : edges_(std::make_unique<Edge[]>(moves.size())), size_(moves.size()) {
-    auto* edge = edges_.get();
-    for (auto move : moves) edge++->SetMove(move);
+EdgeList::EdgeList(const MoveList& moves) : size_(moves.size()) {
+    static_assert(alignof(std::atomic<Node*>) % sizeof(Edge) == 0,
+                  "Child slots must be aligned after padded edges");
+    if (!size_) return;
+    edges_ = static_cast<Edge*>(
+        TreeMemoryPool::Get().Allocate(AllocatedBytes(size_)));
+    auto* edge = edges_;
+    for (auto move : moves) (new (edge++) Edge())->SetMove(move);
+    auto* child = children();
+    for (int i = 0; i < size_; ++i) new (child++) std::atomic<Node*>(nullptr);
+}
+
+EdgeList::EdgeList(EdgeList&& other)
+    : edges_(other.edges_), size_(other.size_) {
+    other.edges_ = nullptr;
+    other.size_ = 0;
+}
+
+EdgeList& EdgeList::operator=(EdgeList&& other) {
+    std::swap(edges_, other.edges_);
+    std::swap(size_, other.size_);
+    return *this;
+}
+
+EdgeList::~EdgeList() {
+    if (!edges_) return;
+    // Edges and slots are trivially destructible, but slots own nodes.
+    auto* child = children();
+    for (int i = 0; i < size_; ++i) {
+        Node* node = (child++)->load();
+        if (!IsNodeLink(node)) delete node;
+    }
+    TreeMemoryPool::Get().Free(edges_, AllocatedBytes(size_));
 }
 
 /////////////////////////////////////////////////////////////////////////
 // Node
 /////////////////////////////////////////////////////////////////////////
 
+static_assert(sizeof(void*) != 8 || sizeof(Node) == 48,
+              "Node should take 48 bytes on 64-bit platforms");
+
 Node* Node::CreateSingleChildNode(Move move) {
     assert(!edges_);
-    assert(!child_);
     edges_ = EdgeList({move});
-    child_ = std::make_unique<Node>(this, 0);
-    return child_.get();
+    Node* child = new Node(this, 0);
+    edges_.children()[0].store(child, std::memory_order_release);
+    return child;
 }
 
 void Node::CreateEdges(const MoveList& moves) {
     assert(!edges_);
-    assert(!child_);
     edges_ = EdgeList(moves);
 }
 
-Node::ConstIterator Node::Edges() const { return {edges_, &child_}; }
-Node::Iterator Node::Edges() { return {edges_, &child_}; }
+Node::ConstIterator Node::Edges() const { return {edges_}; }
+Node::Iterator Node::Edges() { return {edges_}; }
+Node::Iterator Node::EdgeAt(int idx) { return {edges_, uint16_t(idx)}; }
 
-float Node::GetVisitedPolicy() const { return visited_policy_; }
+float Node::GetVisitedPolicy() const {
+    return visited_policy_.load(std::memory_order_relaxed);
+}
 
 Edge* Node::GetEdgeToNode(const Node* node) const {
     assert(node->parent_ == this);
@@ -152,78 +396,182 @@ Edge* Node::GetEdgeToNode(const Node* node) const {
 std::string Node::DebugString() const {
     std::ostringstream oss;
     oss << " Term:" << is_terminal_ << " This:" << this << " Parent:" << parent_
-        << " Index:" << index_ << " Child:" << child_.get()
-        << " Sibling:" << sibling_.get() << " Q:" << q_ << " N:" << n_
-        << " N_:" << n_in_flight_ << " Edges:" << edges_.size();
+        << " Index:" << index_ << " Q:" << GetQ() << " N:" << GetN()
+        << " N_:" << GetNInFlight() << " Edges:" << edges_.size();
     return oss.str();
 }
 
 void Node::MakeTerminal(GameResult result) {
     is_terminal_ = true;
-    q_ = (result == GameResult::DRAW) ? 0.0f : 1.0f;
+    q_.store((result == GameResult::DRAW) ? 0.0f : 1.0f,
+             std::memory_order_relaxed);
 }
 
 bool Node::TryStartScoreUpdate() {
-    if (n_ == 0 && n_in_flight_ > 0) return false;
-    ++n_in_flight_;
+    if (n_.load(std::memory_order_acquire) == 0) {
+        // Unvisited node, only the thread which takes n-in-flight from 0 to 1
+        // gets to expand it.
+        uint32_t expected = 0;
+        return n_in_flight_.compare_exchange_strong(expected, 1,
+                                                    std::memory_order_acq_rel);
+    }
+    n_in_flight_.fetch_add(1, std::memory_order_acq_rel);
     return true;
 }
 
-void Node::CancelScoreUpdate() { --n_in_flight_; }
+void Node::CancelScoreUpdate(int multivisit) {
+    n_in_flight_.fetch_sub(multivisit, std::memory_order_acq_rel);
+}
 
-void Node::FinalizeScoreUpdate(float v) {
+void Node::FinalizeScoreUpdate(float v, int multivisit) {
+    // Increment N. Released before N-in-flight drops, so that nobody takes the
+    // node for unexpanded.
+    const uint32_t n = n_.fetch_add(multivisit, std::memory_order_acq_rel);
     // Recompute Q.
-    q_ += (v - q_) / (n_ + 1);
+    float q = q_.load(std::memory_order_relaxed);
+    while (!q_.compare_exchange_weak(
+        q, q + (v - multivisit * q) / (n + multivisit),
+        std::memory_order_relaxed)) {
+    }
     // If first visit, update parent's sum of policies visited at least once.
-    if (n_ == 0 && parent_ != nullptr) {
-        parent_->visited_policy_ += parent_->edges_[index_].GetP();
+    if (n == 0 && parent_ != nullptr) {
+        const float p = parent_->edges_[index_].GetP();
+        auto& visited_policy = parent_->visited_policy_;
+        float visited = visited_policy.load(std::memory_order_relaxed);
+        while (!visited_policy.compare_exchange_weak(
+            visited, visited + p, std::memory_order_relaxed)) {
+        }
     }
-    // Increment N.
-    ++n_;
     // Decrement virtual loss.
-    --n_in_flight_;
+    n_in_flight_.fetch_sub(multivisit, std::memory_order_acq_rel);
 }
 
 void Node::UpdateMaxDepth(int depth) {
-    if (depth > max_depth_) max_depth_ = depth;
+    uint16_t max_depth = max_depth_.load(std::memory_order_relaxed);
+    while (depth > max_depth &&
+           !max_depth_.compare_exchange_weak(max_depth, depth,
+                                             std::memory_order_relaxed)) {
+    }
 }
 
 bool Node::UpdateFullDepth(uint16_t* depth) {
     // TODO(crem) If this function won't be needed, consider also killing
     //            ChildNodes/NodeRange/Nodes_Iterator.
-    if (full_depth_ > *depth) return false;
+    uint16_t full_depth = full_depth_.load(std::memory_order_relaxed);
+    if (full_depth > *depth) return false;
     for (Node* child : ChildNodes()) {
-        if (*depth > child->full_depth_) *depth = child->full_depth_;
+        const uint16_t child_depth = child->GetFullDepth();
+        if (*depth > child_depth) *depth = child_depth;
     }
-    if (*depth >= full_depth_) {
-        full_depth_ = ++*depth;
-        return true;
+    // Several threads may race here; the larger depth wins.
+    while (*depth >= full_depth) {
+        if (full_depth_.compare_exchange_weak(full_depth, *depth + 1,
+                                              std::memory_order_relaxed)) {
+            ++*depth;
+            return true;
+        }
     }
     return false;
 }
 
-Node::NodeRange Node::ChildNodes() const { return child_.get(); }
+void Node::Reset() {
+    ReleaseChildren();
+    edges_ = EdgeList();
+    q_.store(0.0f, std::memory_order_relaxed);
+    n_.store(0, std::memory_order_relaxed);
+    n_in_flight_.store(0, std::memory_order_relaxed);
+    visited_policy_.store(0.0f, std::memory_order_relaxed);
+    max_depth_.store(0, std::memory_order_relaxed);
+    full_depth_.store(0, std::memory_order_relaxed);
+    is_terminal_ = false;
+}
+
+Node::NodeRange Node::ChildNodes() const { return edges_; }
+
+Node::~Node() {
+    // Subtrees may be deep, so they are destroyed without recursion: children
+    // are detached before a node is deleted.
+    std::vector<Node*> to_delete;
+    TakeChildren(&to_delete);
+    while (!to_delete.empty()) {
+        Node* node = to_delete.back();
+        to_delete.pop_back();
+        node->TakeChildren(&to_delete);
+        delete node;
+    }
+}
 
-void Node::ReleaseChildren() { gNodeGc.AddToGcQueue(std::move(child_)); }
+void Node::TakeChildren(std::vector<Node*>* children) {
+    auto* child = edges_.children();
+    for (int i = 0; i < edges_.size(); ++i, ++child) {
+        Node* node = child->load(std::memory_order_relaxed);
+        if (!node) continue;
+        child->store(nullptr, std::memory_order_relaxed);
+        if (!IsNodeLink(node)) children->push_back(node);
+    }
+}
+
+void Node::ReleaseChildren() { ReleaseChildrenExceptOne(nullptr); }
 
 void Node::ReleaseChildrenExceptOne(Node* node_to_save) {
-    // Stores node which will have to survive (or nullptr if it's not found).
-    std::unique_ptr<Node> saved_node;
-    // Pointer to unique_ptr, so that we could move from it.
-    for (std::unique_ptr<Node>* node = &child_; *node;
-         node = &(*node)->sibling_) {
-        // If current node is the one that we have to save.
-        if (node->get() == node_to_save) {
-            // Kill all remaining siblings.
-            gNodeGc.AddToGcQueue(std::move((*node)->sibling_));
-            // Save the node, and take the ownership from the unique_ptr.
-            saved_node = std::move(*node);
-            break;
+    auto* child = edges_.children();
+    for (int i = 0; i < edges_.size(); ++i, ++child) {
+        Node* node = child->load(std::memory_order_relaxed);
+        if (node == node_to_save) continue;
+        child->store(nullptr, std::memory_order_relaxed);
+        if (!IsNodeLink(node)) {
+            gNodeGc.AddToGcQueue(std::unique_ptr<Node>(node));
+        }
+    }
+}
+
+void Node::PruneChildren(std::vector<Node*>* children) {
+    TakeChildren(children);
+    // Children are spawned again on their first visit, and add their priors
+    // back then.
+    visited_policy_.store(0.0f, std::memory_order_relaxed);
+}
+
+std::unique_ptr<Node> Node::LinkChild(Node* node, Node* shared) {
+    assert(node->parent_ == this);
+    edges_.children()[node->index_].store(MakeNodeLink(shared),
+                                          std::memory_order_release);
+    return std::unique_ptr<Node>(node);
+}
+
+void Node::UnlinkTranspositions() {
+    // Trees may be deep, so no recursion.
+    std::vector<Node*> to_visit = {this};
+    while (!to_visit.empty()) {
+        Node* node = to_visit.back();
+        to_visit.pop_back();
+        auto* child = node->edges_.children();
+        for (int i = 0; i < node->edges_.size(); ++i, ++child) {
+            Node* slot = child->load(std::memory_order_relaxed);
+            if (IsNodeLink(slot)) {
+                child->store(nullptr, std::memory_order_relaxed);
+            } else if (slot) {
+                to_visit.push_back(slot);
+            }
         }
     }
-    // Make saved node the only child. (kills previous siblings).
-    gNodeGc.AddToGcQueue(std::move(child_));
-    child_ = std::move(saved_node);
+}
+
+size_t Node::GetSubtreeBytes() const {
+    size_t bytes = 0;
+    // Trees may be deep, so no recursion.
+    std::vector<const Node*> to_visit = {this};
+    while (!to_visit.empty()) {
+        const Node* node = to_visit.back();
+        to_visit.pop_back();
+        bytes += sizeof(Node) + EdgeList::AllocatedBytes(node->edges_.size());
+        auto* child = node->edges_.children();
+        for (int i = 0; i < node->edges_.size(); ++i, ++child) {
+            Node* slot = child->load(std::memory_order_acquire);
+            if (slot && !IsNodeLink(slot)) to_visit.push_back(slot);
+        }
+    }
+    return bytes;
 }
 
 namespace {
@@ -294,6 +642,30 @@ std::string EdgeAndNode::DebugString() const {
            (node_ ? node_->DebugString() : "(no node)");
 }
 
+/////////////////////////////////////////////////////////////////////////
+// TranspositionTable
+/////////////////////////////////////////////////////////////////////////
+
+Node* TranspositionTable::FindOrInsert(uint64_t key, Node* node) {
+    auto& shard = shards_[key % kShards];
+    lookups_.fetch_add(1, std::memory_order_relaxed);
+    Mutex::Lock lock(shard.mutex);
+    auto result = shard.nodes.emplace(key, node);
+    if (!result.second) hits_.fetch_add(1, std::memory_order_relaxed);
+    return result.first->second;
+}
+
+TranspositionTable::Stats TranspositionTable::GetStats() const {
+    Stats stats;
+    stats.lookups = lookups_.load(std::memory_order_relaxed);
+    stats.hits = hits_.load(std::memory_order_relaxed);
+    for (const auto& shard : shards_) {
+        Mutex::Lock lock(shard.mutex);
+        stats.size += shard.nodes.size();
+    }
+    return stats;
+}
+
 /////////////////////////////////////////////////////////////////////////
 // NodeTree
 /////////////////////////////////////////////////////////////////////////
@@ -315,11 +687,8 @@ void NodeTree::MakeMove(Move move) {
 }
 
 void NodeTree::TrimTreeAtHead() {
-    auto tmp = std::move(current_head_->sibling_);
     // Send dependent nodes for GC instead of destroying them immediately.
-    gNodeGc.AddToGcQueue(std::move(current_head_->child_));
-    *current_head_ = Node(current_head_->GetParent(), current_head_->index_);
-    current_head_->sibling_ = std::move(tmp);
+    current_head_->Reset();
 }
 
 void NodeTree::ResetToPosition(const std::string& starting_fen,
@@ -351,7 +720,6 @@ void NodeTree::ResetToPosition(const std::string& starting_fen,
     // If we didn't see old head, it means that new position is shorter.
     // As we killed the search tree already, trim it to redo the search.
     if (!seen_old_head) {
-        assert(!current_head_->sibling_);
         TrimTreeAtHead();
     }
 }
@@ -18,24 +18,34 @@
 
 #pragma once
 
+#include <atomic>
 #include <iostream>
 #include <memory>
 #include <mutex>
+#include <unordered_map>
+#include <vector>
 
 #include "chess/board.h"
 #include "chess/callbacks.h"
 #include "chess/position.h"
 #include "neural/writer.h"
 #include "utils/mutex.h"
+#include "utils/probability.h"
 
 namespace cczero {
 
 // Children of a node are stored the following way:
 // * Edges and Nodes edges point to are stored separately.
 // * There may be dangling edges (which don't yet point to any Node object yet)
-// * Edges are stored are a simple array on heap.
-// * Nodes are stored as a linked list, and contain index_ field which shows
-//   which edge of a parent that node points to.
+// * Edges are stored are a simple array, allocated from TreeMemoryPool.
+// * Right after edges (padded to pointer alignment), in the same allocation,
+//   there is an array of child slots, one per edge. A slot owns the Node of
+//   its edge, or is empty. Slots are atomic so that search threads can spawn
+//   nodes without locking. Nodes contain index_ field which shows which edge
+//   of a parent they belong to.
+// * With transpositions enabled, a slot may instead hold a link to a node of
+//   the same position owned by another parent. Links are tagged with the
+//   lowest pointer bit and are removed when the search ends.
 //
 // Example:
 //                                Parent Node
@@ -49,19 +59,67 @@ namespace cczero {
 //  Is represented as:
 // +--------------+
 // | Parent Node  |
-// +--------------+                                        +--------+
-// | edges_       | -------------------------------------> | Edge[] |
-// |              |    +------------+                      +--------+
-// | child_       | -> | Node       |                      | Nf3    |
-// +--------------+    +------------+                      | Bc5    |
-//                     | index_ = 1 |                      | a4     |
-//                     | q_ = 0.5   |    +------------+    | Qxf7   |
-//                     | sibling_   | -> | Node       |    | a3     |
-//                     +------------+    +------------+    +--------+
-//                                       | index_ = 3 |
-//                                       | q_ = -0.2  |
-//                                       | sibling_   | -> nullptr
-//                                       +------------+
+// +--------------+    +--------+----------+
+// | edges_       | -> | Edge[] | Slots[]  |
+// +--------------+    +--------+----------+
+//                     | Nf3    | nullptr  |
+//                     | Bc5    | ---------+--> Node, index_ = 1, q_ = 0.5
+//                     | a4     | nullptr  |
+//                     | Qxf7   | ---------+--> Node, index_ = 3, q_ = -0.2
+//                     | a3     | nullptr  |
+//                     +--------+----------+
+
+// Memory pool for search tree nodes and edge arrays.
+// Memory is taken from the system in large slabs and cut into blocks of a few
+// size classes. Freed blocks are kept in free lists and reused, so that growing
+// and garbage collecting the tree doesn't fragment the heap. Every thread
+// caches free blocks of every class, and blocks move between thread caches and
+// shared free lists in batches, e.g. when GC thread releases a whole subtree.
+class TreeMemoryPool {
+   public:
+    struct Stats {
+        // Bytes taken from the system.
+        size_t reserved_bytes = 0;
+        // Bytes in blocks which are allocated and not yet freed.
+        size_t used_bytes = 0;
+    };
+
+    // The pool is shared by all trees, so that memory freed by one search
+    // tree is reused by the next one.
+    static TreeMemoryPool& Get();
+
+    void* Allocate(size_t size);
+    // @size must be the same as in the call to Allocate().
+    void Free(void* ptr, size_t size);
+
+    Stats GetStats() const;
+
+   private:
+    struct FreeBlock;
+    class ThreadCache;
+
+    TreeMemoryPool() = default;
+    static ThreadCache& GetThreadCache();
+    // Moves a batch of free blocks of a size class into thread cache.
+    // Returns whether the pool had to reserve more memory.
+    bool Refill(size_t size_class, ThreadCache* cache);
+    // Moves a chain of free blocks from a thread cache into shared free list.
+    void Return(size_t size_class, FreeBlock* head, FreeBlock* tail);
+
+    Mutex mutex_;
+    std::vector<std::unique_ptr<char[]>> slabs_ GUARDED_BY(mutex_);
+    // Unused memory of the latest slab.
+    char* slab_pos_ GUARDED_BY(mutex_) = nullptr;
+    char* slab_end_ GUARDED_BY(mutex_) = nullptr;
+    std::vector<FreeBlock*> free_lists_ GUARDED_BY(mutex_);
+
+    std::atomic<size_t> reserved_bytes_{0};
+    std::atomic<size_t> used_bytes_{0};
+};
+
+// Released subtrees are destroyed in background threads. Sets how many of them
+// may work at once when the tree memory pool is under pressure.
+void SetNodeGcThreads(int threads);
 
 class Node;
 class Edge {
@@ -72,10 +130,11 @@ class Edge {
 
     // Returns value of Move probability returned from the neural net
     // (but can be changed by adding Dirichlet noise).
-    float GetP() const { return p_; }
+    float GetP() const { return DecompressProbability(p_); }
 
-    // Sets move probability.
-    void SetP(float val) { p_ = val; }
+    // Sets move probability, which has to be in [0, 1]. It's rounded to
+    // about 3.5 significant digits.
+    void SetP(float val) { p_ = CompressProbability(val); }
 
     // Debug information about the edge.
     std::string DebugString() const;
@@ -89,24 +148,60 @@ class Edge {
     Move move_;
 
     // Probability that this move will be made. From policy head of the neural
-    // network.
-    float p_ = 0.0;
+    // network. Compressed to 16 bits, so that an Edge takes 4 bytes.
+    uint16_t p_ = 0;
 
     friend class EdgeList;
 };
 
-// Array of Edges.
+// Links to nodes owned by other parents are stored in child slots with the
+// lowest bit set.
+inline bool IsNodeLink(const Node* slot) {
+    return reinterpret_cast<uintptr_t>(slot) & 1;
+}
+inline Node* MakeNodeLink(Node* node) {
+    return reinterpret_cast<Node*>(reinterpret_cast<uintptr_t>(node) | 1);
+}
+inline Node* NodeFromSlot(Node* slot) {
+    return reinterpret_cast<Node*>(reinterpret_cast<uintptr_t>(slot) &
+                                   ~uintptr_t(1));
+}
+
+// Array of Edges together with child slots, allocated from TreeMemoryPool.
+// Owns child nodes, except linked ones.
 class EdgeList {
    public:
     EdgeList() {}
-    EdgeList(MoveList moves);
-    Edge* get() const { return edges_.get(); }
+    EdgeList(const MoveList& moves);
+    EdgeList(EdgeList&& other);
+    EdgeList& operator=(EdgeList&& other);
+    ~EdgeList();
+
+    Edge* get() const { return edges_; }
     Edge& operator[](size_t idx) const { return edges_[idx]; }
-    operator bool() const { return static_cast<bool>(edges_); }
+    operator bool() const { return edges_ != nullptr; }
     uint16_t size() const { return size_; }
 
+    // Child slots, size() of them. Slot idx holds node of edge idx.
+    std::atomic<Node*>* children() const {
+        return reinterpret_cast<std::atomic<Node*>*>(edges_ +
+                                                     PaddedSize(size_));
+    }
+
+    // Number of edges followed by padding, so that slots are aligned.
+    static size_t PaddedSize(size_t size) {
+        constexpr size_t kEdgesPerSlot =
+            alignof(std::atomic<Node*>) / sizeof(Edge);
+        return (size + kEdgesPerSlot - 1) / kEdgesPerSlot * kEdgesPerSlot;
+    }
+    // Bytes taken from TreeMemoryPool for @size edges and their slots.
+    static size_t AllocatedBytes(size_t size) {
+        return sizeof(Edge) * PaddedSize(size) +
+               sizeof(std::atomic<Node*>) * size;
+    }
+
    private:
-    std::unique_ptr<Edge[]> edges_;
+    Edge* edges_ = nullptr;
     uint16_t size_ = 0;
 };
 
@@ -120,7 +215,16 @@ class Node {
     using ConstIterator = Edge_Iterator<true>;
 
     // Takes pointer to a parent node and own index in a parent.
-    Node(Node* parent, uint16_t index) : index_(index), parent_(parent) {}
+    Node(Node* parent, uint16_t index) : parent_(parent), index_(index) {}
+    ~Node();
+
+    // Nodes are allocated from TreeMemoryPool.
+    static void* operator new(size_t size) {
+        return TreeMemoryPool::Get().Allocate(size);
+    }
+    static void operator delete(void* ptr, size_t size) {
+        TreeMemoryPool::Get().Free(ptr, size);
+    }
 
     // Allocates a new edge and a new node. The node has to be no edges before
     // that.
@@ -137,14 +241,19 @@ class Node {
 
     // Returns sum of policy priors which have had at least one playout.
     float GetVisitedPolicy() const;
-    uint32_t GetN() const { return n_; }
-    uint32_t GetNInFlight() const { return n_in_flight_; }
-    uint32_t GetChildrenVisits() const { return n_ > 0 ? n_ - 1 : 0; }
+    uint32_t GetN() const { return n_.load(std::memory_order_acquire); }
+    uint32_t GetNInFlight() const {
+        return n_in_flight_.load(std::memory_order_acquire);
+    }
+    uint32_t GetChildrenVisits() const {
+        const uint32_t n = GetN();
+        return n > 0 ? n - 1 : 0;
+    }
     // Returns n = n_if_flight.
-    int GetNStarted() const { return n_ + n_in_flight_; }
+    int GetNStarted() const { return GetN() + GetNInFlight(); }
     // Returns node eval, i.e. average subtree V for non-terminal node and
     // -1/0/1 for terminal nodes.
-    float GetQ() const { return q_; }
+    float GetQ() const { return q_.load(std::memory_order_relaxed); }
 
     // Returns whether the node is known to be draw/lose/win.
     bool IsTerminal() const { return is_terminal_; }
@@ -158,16 +267,19 @@ class Node {
     // If this node is not in the process of being expanded by another thread
     // (which can happen only if n==0 and n-in-flight==1), mark the node as
     // "being updated" by incrementing n-in-flight, and return true.
-    // Otherwise return false.
+    // Otherwise return false. Only one thread can start the update of a node
+    // with n==0.
     bool TryStartScoreUpdate();
-    // Decrements n-in-flight back.
-    void CancelScoreUpdate();
-    // Updates the node with newly computed value v.
+    // Decrements n-in-flight back by @multivisit.
+    void CancelScoreUpdate(int multivisit = 1);
+    // Updates the node with @multivisit newly computed values, which sum up
+    // to @v.
     // Updates:
     // * Q (weighted average of all V in a subtree)
-    // * N (+=1)
-    // * N-in-flight (-=1)
-    void FinalizeScoreUpdate(float v);
+    // * N (+=multivisit)
+    // * N-in-flight (-=multivisit)
+    // Safe to call concurrently from several threads.
+    void FinalizeScoreUpdate(float v, int multivisit = 1);
 
     // Updates max depth, if new depth is larger.
     void UpdateMaxDepth(int depth);
@@ -182,60 +294,88 @@ class Node {
     // Returns range for iterating over edges.
     ConstIterator Edges() const;
     Iterator Edges();
+    // Returns iterator pointing to the edge with a given index.
+    Iterator EdgeAt(int idx);
 
     class NodeRange;
     // Returns range for iterating over nodes. Note that there may be edges
     // without nodes, which will be skipped by this iteration.
     NodeRange ChildNodes() const;
 
+    // Moves owned children into @children, leaving their edges without nodes.
+    // Used to destroy subtrees without recursion.
+    void TakeChildren(std::vector<Node*>* children);
+
     // Deletes all children.
     void ReleaseChildren();
 
     // Deletes all children except one.
     void ReleaseChildrenExceptOne(Node* node);
 
+    // Drops children to release memory, keeping edges, N and Q. The node is
+    // then descended as if none of its children had been visited. Owned
+    // children are moved into @children.
+    void PruneChildren(std::vector<Node*>* children);
+
+    // Replaces child @node with a link to @shared, a node of the same position
+    // owned by another parent. Returns the replaced node.
+    std::unique_ptr<Node> LinkChild(Node* node, Node* shared);
+
+    // Removes links from all nodes of the subtree, leaving their edges
+    // without nodes.
+    void UnlinkTranspositions();
+
     // For a child node, returns corresponding edge.
     Edge* GetEdgeToNode(const Node* node) const;
 
+    // Returns bytes taken from TreeMemoryPool by the node and its subtree,
+    // not counting nodes linked from it.
+    size_t GetSubtreeBytes() const;
+
     // Debug information about the node.
     std::string DebugString() const;
 
    private:
+    // Brings the node back to the unvisited state, dropping its children.
+    void Reset();
+
+    // Counters and evals are atomic, so that search threads can select and
+    // back up concurrently. Edges and is_terminal_ are only written by the
+    // thread which expands the node, before the first visit is finalized; n_
+    // is released after that, so readers that see n_ > 0 also see them.
+
+    // Fields are ordered by size, so that a Node takes 48 bytes and fits a
+    // cache line.
+
     // List of edges.
     EdgeList edges_;
-    // Index of this node is parent's edge list.
-    uint16_t index_;
+    // Pointer to a parent node. nullptr for the root.
+    Node* parent_ = nullptr;
     // Average value (from value head of neural network) of all visited nodes in
     // subtree. For terminal nodes, eval is stored.
-    float q_ = 0.0f;
+    std::atomic<float> q_{0.0f};
     // How many completed visits this node had.
-    uint32_t n_ = 0;
+    std::atomic<uint32_t> n_{0};
+    // Sum of policy priors which have had at least one playout.
+    std::atomic<float> visited_policy_{0.0f};
     // (aka virtual loss). How many threads currently process this node (started
     // but not finished). This value is added to n during selection which node
-    // to pick in MCTS, and also when selecting the best move.
-    uint16_t n_in_flight_ = 0;
-    // Sum of policy priors which have had at least one playout.
-    float visited_policy_ = 0.0f;
-
+    // to pick in MCTS, and also when selecting the best move. 32 bits wide, as
+    // pipelined minibatches of many threads can hold more than 65535 visits.
+    std::atomic<uint32_t> n_in_flight_{0};
+    // Index of this node is parent's edge list.
+    uint16_t index_;
     // Maximum depth any subnodes of this node were looked at.
-    uint16_t max_depth_ = 0;
+    std::atomic<uint16_t> max_depth_{0};
     // Complete depth all subnodes of this node were fully searched.
-    uint16_t full_depth_ = 0;
+    std::atomic<uint16_t> full_depth_{0};
     // Does this node end game (with a winning of either sides or draw).
     bool is_terminal_ = false;
 
-    // Pointer to a parent node. nullptr for the root.
-    Node* parent_ = nullptr;
-    // Pointer to a first child. nullptr for a leaf node.
-    std::unique_ptr<Node> child_;
-    // Pointer to a next sibling. nullptr if there are no further siblings.
-    std::unique_ptr<Node> sibling_;
-
     // TODO(mooskagh) Unfriend NodeTree.
     friend class NodeTree;
     friend class Edge_Iterator<true>;
     friend class Edge_Iterator<false>;
-    friend class Node_Iterator;
     friend class Edge;
 };
 
@@ -305,20 +445,29 @@ class EdgeAndNode {
 template <bool is_const>
 class Edge_Iterator : public EdgeAndNode {
    public:
-    using Ptr = std::conditional_t<is_const, const std::unique_ptr<Node>*,
-                                   std::unique_ptr<Node>*>;
+    using Ptr = std::conditional_t<is_const, const std::atomic<Node*>*,
+                                   std::atomic<Node*>*>;
 
     // Creates "end()" iterator.
     Edge_Iterator() {}
 
     // Creates "begin()" iterator. Also happens to be a range constructor.
-    Edge_Iterator(const EdgeList& edges, Ptr node_ptr)
+    Edge_Iterator(const EdgeList& edges)
         : EdgeAndNode(edges.size() ? edges.get() : nullptr, nullptr),
-          node_ptr_(node_ptr),
+          node_ptr_(edges.children()),
           total_count_(edges.size()) {
         if (edge_) Actualize();
     }
 
+    // Creates iterator pointing to the idx-th edge.
+    Edge_Iterator(const EdgeList& edges, uint16_t idx)
+        : EdgeAndNode(edges.get() + idx, nullptr),
+          node_ptr_(edges.children() + idx),
+          current_idx_(idx),
+          total_count_(edges.size()) {
+        Actualize();
+    }
+
     // Function to support range interface.
     Edge_Iterator<is_const> begin() { return *this; }
     Edge_Iterator<is_const> end() { return {}; }
@@ -331,91 +480,115 @@ class Edge_Iterator : public EdgeAndNode {
             edge_ = nullptr;
         } else {
             ++edge_;
+            ++node_ptr_;
             Actualize();
         }
     }
     Edge_Iterator& operator*() { return *this; }
 
     // If there is node, return it. Otherwise spawn a new one and return it.
-    Node* GetOrSpawnNode(Node* parent) {
+    // If several threads spawn the same node, only one of them wins.
+    // If @spawned is not nullptr, sets it to whether this call added the node.
+    Node* GetOrSpawnNode(Node* parent, bool* spawned = nullptr) {
+        if (spawned) *spawned = false;
         if (node_) return node_;  // If there is already a node, return it.
         Actualize();              // But maybe other thread already did that.
         if (node_) return node_;  // If it did, return.
         // Now we are sure we have to create a new node.
-        // Suppose there are nodes with idx 3 and 7, and we want to insert one
-        // with idx 5. Here is how it looks like:
-        //    node_ptr_ -> &Node(idx_.3).sibling_  ->  Node(idx_.7)
-        // Here is how we do that:
-        // 1. Store pointer to a node idx_.7:
-        //    node_ptr_ -> &Node(idx_.3).sibling_  ->  nullptr
-        //    tmp -> Node(idx_.7)
-        std::unique_ptr<Node> tmp = std::move(*node_ptr_);
-        // 2. Create fresh Node(idx_.5):
-        //    node_ptr_ -> &Node(idx_.3).sibling_  ->  Node(idx_.5)
-        //    tmp -> Node(idx_.7)
-        *node_ptr_ = std::make_unique<Node>(parent, current_idx_);
-        // 3. Attach stored pointer back to a list:
-        //    node_ptr_ ->
-        //         &Node(idx_.3).sibling_ -> Node(idx_.5).sibling_ ->
-        //         Node(idx_.7)
-        (*node_ptr_)->sibling_ = std::move(tmp);
-        // 4. Actualize:
-        //    node_ -> &Node(idx_.5)
-        //    node_ptr_ -> &Node(idx_.5).sibling_ -> Node(idx_.7)
-        Actualize();
+        Node* new_node = new Node(parent, current_idx_);
+        Node* expected = nullptr;
+        if (node_ptr_->compare_exchange_strong(expected, new_node,
+                                               std::memory_order_acq_rel)) {
+            node_ = new_node;
+            if (spawned) *spawned = true;
+        } else {
+            // Another thread was faster, use its node. The slot may hold a
+            // transposition link rather than a plain child.
+            delete new_node;
+            node_ = NodeFromSlot(expected);
+        }
         return node_;
     }
 
    private:
     void Actualize() {
-        // If node_ptr_ is behind, advance it.
-        // This is needed (and has to be 'while' rather than 'if') as other
-        // threads could spawn new nodes between &node_ptr_ and *node_ptr_ while
-        // we didn't see.
-        while (*node_ptr_ && (*node_ptr_)->index_ < current_idx_) {
-            node_ptr_ = &(*node_ptr_)->sibling_;
-        }
-        // If in the end node_ptr_ points to the node that we need, populate
-        // node_ and advance node_ptr_.
-        if (*node_ptr_ && (*node_ptr_)->index_ == current_idx_) {
-            node_ = (*node_ptr_).get();
-            node_ptr_ = &node_->sibling_;
-        } else {
-            node_ = nullptr;
-        }
+        node_ = NodeFromSlot(node_ptr_->load(std::memory_order_acquire));
     }
 
-    // Pointer to a pointer to the next node. Has to be a pointer to pointer
-    // as we'd like to update it when spawning a new node.
-    Ptr node_ptr_;
+    // Pointer to the child slot of the current edge.
+    Ptr node_ptr_ = nullptr;
     uint16_t current_idx_ = 0;
     uint16_t total_count_ = 0;
 };
 
 class Node_Iterator {
    public:
-    Node_Iterator(Node* node) : node_(node) {}
-    Node* operator*() { return node_; }
-    Node* operator->() { return node_; }
-    bool operator==(Node_Iterator& other) { return node_ == other.node_; }
-    bool operator!=(Node_Iterator& other) { return node_ != other.node_; }
-    void operator++() { node_ = node_->sibling_.get(); }
+    Node_Iterator(const std::atomic<Node*>* slot, const std::atomic<Node*>* end)
+        : slot_(slot), end_(end) {
+        SkipEmpty();
+    }
+    Node* operator*() {
+        return NodeFromSlot(slot_->load(std::memory_order_acquire));
+    }
+    Node* operator->() { return **this; }
+    bool operator==(Node_Iterator& other) { return slot_ == other.slot_; }
+    bool operator!=(Node_Iterator& other) { return slot_ != other.slot_; }
+    void operator++() {
+        ++slot_;
+        SkipEmpty();
+    }
 
    private:
-    Node* node_;
+    void SkipEmpty() {
+        while (slot_ != end_ && !slot_->load(std::memory_order_acquire)) {
+            ++slot_;
+        }
+    }
+
+    const std::atomic<Node*>* slot_;
+    const std::atomic<Node*>* end_;
 };
 
 class Node::NodeRange {
    public:
-    Node_Iterator begin() { return Node_Iterator(node_); }
-    Node_Iterator end() { return Node_Iterator(nullptr); }
+    Node_Iterator begin() { return Node_Iterator(begin_, end_); }
+    Node_Iterator end() { return Node_Iterator(end_, end_); }
 
    private:
-    NodeRange(Node* node) : node_(node) {}
-    Node* node_;
+    NodeRange(const EdgeList& edges)
+        : begin_(edges.children()), end_(edges.children() + edges.size()) {}
+    const std::atomic<Node*>* begin_;
+    const std::atomic<Node*>* end_;
     friend class Node;
 };
 
+// Concurrent map from position keys to nodes, used to share subtrees of
+// transposed positions. Doesn't own nodes.
+class TranspositionTable {
+   public:
+    struct Stats {
+        uint64_t lookups = 0;
+        uint64_t hits = 0;
+        size_t size = 0;
+    };
+
+    // Returns node stored under @key. If there is none, stores @node and
+    // returns it.
+    Node* FindOrInsert(uint64_t key, Node* node);
+    Stats GetStats() const;
+
+   private:
+    static const int kShards = 64;
+    struct Shard {
+        mutable Mutex mutex;
+        std::unordered_map<uint64_t, Node*> nodes GUARDED_BY(mutex);
+    };
+
+    Shard shards_[kShards];
+    std::atomic<uint64_t> lookups_{0};
+    std::atomic<uint64_t> hits_{0};
+};
+
 class NodeTree {
    public:
     ~NodeTree() { DeallocateTree(); }
@@ -19,15 +19,22 @@
 #include <algorithm>
 #include <chrono>
 #include <cmath>
+#include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <limits>
 #include <sstream>
 #include <thread>
 
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
 #include "mcts/node.h"
 #include "mcts/search.h"
 #include "neural/cache.h"
 #include "neural/encoder.h"
+#include "utils/hashcat.h"
 #include "utils/random.h"
 
 namespace cczero {
@@ -46,12 +53,28 @@ const char* Search::kCacheHistoryLengthStr =
 const char* Search::kPolicySoftmaxTempStr = "Policy softmax temperature";
 const char* Search::kAllowedNodeCollisionsStr =
     "Allowed node collisions, per batch";
+const char* Search::kSnapshotIntervalStr =
+    "Plies between cached position snapshots";
+const char* Search::kSnapshotCacheSizeStr =
+    "Cached position snapshots, per thread";
+const char* Search::kPipelineDepthStr = "Minibatches in flight, per thread";
+const char* Search::kTranspositionsStr = "Share nodes of transposed positions";
+const char* Search::kGcThreadsStr = "Threads releasing old search trees";
+const char* Search::kTreeMemoryLimitStr = "Search tree memory limit, MiB";
+const char* Search::kCacheStatsIntervalStr = "NNCache stats interval, ms";
+const char* Search::kCacheStatsFileStr = "NNCache stats file";
 
 namespace {
 const int kSmartPruningToleranceNodes = 100;
 const int kSmartPruningToleranceMs = 200;
 // Maximum delay between outputting "uci info" when nothing interesting happens.
 const int kUciInfoMinimumFrequencyMs = 5000;
+// Closer than that to the no-capture draw, positions are only shared with the
+// same no-capture ply count.
+const int kTranspositionExactNoCapturePly = 50;
+// Pruning the tree at the memory limit aims to bring tree memory down to this
+// fraction of the limit.
+const float kTreeMemoryAfterPruning = 0.75f;
 }  // namespace
 
 void Search::PopulateUciParams(OptionsParser* options) {
@@ -76,6 +99,18 @@ void Search::PopulateUciParams(OptionsParser* options) {
                               "policy-softmax-temp") = 1.0f;
     options->Add<IntOption>(kAllowedNodeCollisionsStr, 0, 1024,
                             "allowed-node-collisions") = 0;
+    options->Add<IntOption>(kSnapshotIntervalStr, 0, 100,
+                            "snapshot-interval") = 0;
+    options->Add<IntOption>(kSnapshotCacheSizeStr, 0, 10000000,
+                            "snapshot-cache-size") = 20000;
+    options->Add<IntOption>(kPipelineDepthStr, 1, 8, "pipeline-depth") = 1;
+    options->Add<BoolOption>(kTranspositionsStr, "transpositions") = false;
+    options->Add<IntOption>(kGcThreadsStr, 1, 16, "gc-threads") = 1;
+    options->Add<IntOption>(kTreeMemoryLimitStr, 0, 1024 * 1024,
+                            "tree-memory-limit") = 0;
+    options->Add<IntOption>(kCacheStatsIntervalStr, 0, 3600000,
+                            "nncache-stats-interval") = 0;
+    options->Add<StringOption>(kCacheStatsFileStr, "nncache-stats-file");
 }
 
 Search::Search(const NodeTree& tree, Network* network,
@@ -102,9 +137,103 @@ Search::Search(const NodeTree& tree, Network* network,
       kFpuReduction(options.Get<float>(kFpuReductionStr)),
       kCacheHistoryLength(options.Get<int>(kCacheHistoryLengthStr)),
       kPolicySoftmaxTemp(options.Get<float>(kPolicySoftmaxTempStr)),
-      kAllowedNodeCollisions(options.Get<int>(kAllowedNodeCollisionsStr)) {}
+      kAllowedNodeCollisions(options.Get<int>(kAllowedNodeCollisionsStr)),
+      kSnapshotInterval(options.Get<int>(kSnapshotIntervalStr)),
+      kSnapshotCacheSize(options.Get<int>(kSnapshotCacheSizeStr)),
+      kPipelineDepth(options.Get<int>(kPipelineDepthStr)),
+      kTranspositions(options.Get<bool>(kTranspositionsStr)),
+      kTreeMemoryLimit(
+          static_cast<size_t>(options.Get<int>(kTreeMemoryLimitStr)) << 20),
+      kCacheStatsInterval(options.Get<int>(kCacheStatsIntervalStr)),
+      kCacheStatsFile(options.Get<std::string>(kCacheStatsFileStr)) {
+    SetNodeGcThreads(options.Get<int>(kGcThreadsStr));
+    // Walks the tree left from previous moves once; from then on workers
+    // account for what they add and remove.
+    AddTreeBytes(root_node_->GetSubtreeBytes());
+}
 
 namespace {
+// Edge arrays for PuctArgmax() are padded to a multiple of this.
+const int kPuctLanes = 8;
+
+// Returns index of the first edge with the highest P*mult/(1+N)+Q, or -1 if
+// no score exceeds -100. Arrays must hold a multiple of kPuctLanes floats,
+// padding has Q of -infinity.
+int PuctArgmax(const float* p, const float* n, const float* q, int count,
+               float puct_mult) {
+#if defined(__AVX2__)
+    const __m256 mult = _mm256_set1_ps(puct_mult);
+    const __m256 one = _mm256_set1_ps(1.0f);
+    __m256 best = _mm256_set1_ps(-100.0f);
+    __m256i best_idx = _mm256_set1_epi32(-1);
+    __m256i idx = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i step = _mm256_set1_epi32(8);
+    for (int i = 0; i < count; i += 8) {
+        const __m256 u =
+            _mm256_div_ps(_mm256_mul_ps(mult, _mm256_loadu_ps(p + i)),
+                          _mm256_add_ps(one, _mm256_loadu_ps(n + i)));
+        const __m256 score = _mm256_add_ps(u, _mm256_loadu_ps(q + i));
+        const __m256 better = _mm256_cmp_ps(score, best, _CMP_GT_OQ);
+        best = _mm256_blendv_ps(best, score, better);
+        best_idx =
+            _mm256_blendv_epi8(best_idx, idx, _mm256_castps_si256(better));
+        idx = _mm256_add_epi32(idx, step);
+    }
+    alignas(32) float lane_best[8];
+    alignas(32) int lane_idx[8];
+    _mm256_store_ps(lane_best, best);
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lane_idx), best_idx);
+    const int lanes = 8;
+#elif defined(__SSE2__)
+    const __m128 mult = _mm_set1_ps(puct_mult);
+    const __m128 one = _mm_set1_ps(1.0f);
+    __m128 best = _mm_set1_ps(-100.0f);
+    __m128i best_idx = _mm_set1_epi32(-1);
+    __m128i idx = _mm_setr_epi32(0, 1, 2, 3);
+    const __m128i step = _mm_set1_epi32(4);
+    for (int i = 0; i < count; i += 4) {
+        const __m128 u = _mm_div_ps(_mm_mul_ps(mult, _mm_loadu_ps(p + i)),
+                                    _mm_add_ps(one, _mm_loadu_ps(n + i)));
+        const __m128 score = _mm_add_ps(u, _mm_loadu_ps(q + i));
+        const __m128 better = _mm_cmpgt_ps(score, best);
+        const __m128i mask = _mm_castps_si128(better);
+        best =
+            _mm_or_ps(_mm_and_ps(better, score), _mm_andnot_ps(better, best));
+        best_idx = _mm_or_si128(_mm_and_si128(mask, idx),
+                                _mm_andnot_si128(mask, best_idx));
+        idx = _mm_add_epi32(idx, step);
+    }
+    alignas(16) float lane_best[4];
+    alignas(16) int lane_idx[4];
+    _mm_store_ps(lane_best, best);
+    _mm_store_si128(reinterpret_cast<__m128i*>(lane_idx), best_idx);
+    const int lanes = 4;
+#else
+    float lane_best[1] = {-100.0f};
+    int lane_idx[1] = {-1};
+    for (int i = 0; i < count; ++i) {
+        const float score = puct_mult * p[i] / (1 + n[i]) + q[i];
+        if (score > lane_best[0]) {
+            lane_best[0] = score;
+            lane_idx[0] = i;
+        }
+    }
+    const int lanes = 1;
+#endif
+    // Every lane holds its first maximum, pick the earliest of the best ones.
+    int result = lane_idx[0];
+    float result_score = lane_best[0];
+    for (int i = 1; i < lanes; ++i) {
+        if (lane_idx[i] < 0) continue;
+        if (lane_best[i] > result_score ||
+            (lane_best[i] == result_score && lane_idx[i] < result)) {
+            result = lane_idx[i];
+            result_score = lane_best[i];
+        }
+    }
+    return result;
+}
+
 void ApplyDirichletNoise(Node* node, float eps, double alpha) {
     float total = 0;
     std::vector<float> noise;
@@ -134,6 +263,7 @@ void Search::SendUciInfo() REQUIRES(nodes_mutex_) {
     uci_info_.nodes = total_playouts_ + initial_visits_;
     uci_info_.hashfull =
         cache_->GetSize() * 1000LL / std::max(cache_->GetCapacity(), 1);
+    uci_info_.tree_memory = TreeMemoryPool::Get().GetStats().used_bytes >> 20;
     uci_info_.nps =
         uci_info_.time ? (total_playouts_ * 1000 / uci_info_.time) : 0;
     uci_info_.score =
@@ -141,10 +271,19 @@ void Search::SendUciInfo() REQUIRES(nodes_mutex_) {
     uci_info_.pv.clear();
 
     bool flip = played_history_.IsBlackToMove();
+    std::vector<Node*> pv_nodes;
     for (auto iter = best_move_edge_; iter;
          iter = GetBestChildNoTemperature(iter.node()), flip = !flip) {
         uci_info_.pv.push_back(iter.GetMove(flip));
         if (!iter.node()) break;  // Last edge was dangling, cannot continue.
+        if (kTranspositions) {
+            // Shared nodes may form a cycle.
+            if (std::find(pv_nodes.begin(), pv_nodes.end(), iter.node()) !=
+                pv_nodes.end()) {
+                break;
+            }
+            pv_nodes.push_back(iter.node());
+        }
     }
     uci_info_.comment.clear();
     info_callback_(uci_info_);
@@ -162,6 +301,11 @@ void Search::MaybeOutputInfo() {
          uci_info_.time + kUciInfoMinimumFrequencyMs < GetTimeSinceStart())) {
         SendUciInfo();
     }
+    if (!responded_bestmove_ && kCacheStatsInterval > 0 &&
+        last_cache_stats_time_ + kCacheStatsInterval <= GetTimeSinceStart()) {
+        last_cache_stats_time_ = GetTimeSinceStart();
+        SendCacheStats();
+    }
 }
 
 int64_t Search::GetTimeSinceStart() const {
@@ -220,7 +364,7 @@ void Search::SendMovesStats() const {
             v = edge.node()->GetQ();
         } else {
             NNCacheLock nneval = GetCachedFirstPlyResult(edge);
-            if (nneval) v = -nneval->q;
+            if (nneval) v = -nneval.GetQ();
         }
         if (v) {
             oss << std::setw(7) << std::setprecision(4) << *v;
@@ -234,6 +378,37 @@ void Search::SendMovesStats() const {
     }
 }
 
+void Search::SendTranspositionStats() const {
+    const auto stats = transpositions_.GetStats();
+    std::ostringstream oss;
+    oss << std::fixed << std::setprecision(1) << "transpositions: "
+        << stats.hits << " of " << stats.lookups << " leaves ("
+        << (stats.lookups ? 100.0 * stats.hits / stats.lookups : 0.0)
+        << "%), " << stats.size << " positions";
+    ThinkingInfo info;
+    info.comment = oss.str();
+    info_callback_(info);
+}
+
+void Search::SendCacheStats() const {
+    ThinkingInfo info;
+    info.comment = "nncache " + FormatCacheStats(cache_->GetStats());
+    info_callback_(info);
+}
+
+void Search::WriteCacheStats(const NNCache::Stats& stats) const {
+    std::ofstream file(kCacheStatsFile);
+    file << FormatCacheStats(stats) << std::endl;
+}
+
+void Search::UnlinkTranspositions() {
+    if (!kTranspositions || transpositions_unlinked_) return;
+    transpositions_unlinked_ = true;
+    root_node_->UnlinkTranspositions();
+    Mutex::Lock lock(discarded_nodes_mutex_);
+    discarded_nodes_.clear();
+}
+
 NNCacheLock Search::GetCachedFirstPlyResult(EdgeAndNode edge) const {
     if (!edge.HasNode()) return {};
     assert(edge.node()->GetParent() == root_node_);
@@ -249,35 +424,154 @@ NNCacheLock Search::GetCachedFirstPlyResult(EdgeAndNode edge) const {
 }
 
 void Search::MaybeTriggerStop() {
-    SharedMutex::Lock nodes_lock(nodes_mutex_);
-    Mutex::Lock lock(counters_mutex_);
-    // Don't stop when the root node is not yet expanded.
-    if (total_playouts_ == 0) return;
-    // If smart pruning tells to stop (best move found), stop.
-    if (found_best_move_) {
-        stop_ = true;
-    }
-    // Stop if reached playouts limit.
-    if (limits_.playouts >= 0 && total_playouts_ >= limits_.playouts) {
-        stop_ = true;
-    }
-    // Stop if reached visits limit.
-    if (limits_.visits >= 0 &&
-        total_playouts_ + initial_visits_ >= limits_.visits) {
-        stop_ = true;
-    }
-    // Stop if reached time limit.
-    if (limits_.time_ms >= 0 && GetTimeSinceStart() >= limits_.time_ms) {
-        stop_ = true;
-    }
-    // If we are the first to see that stop is needed.
-    if (stop_ && !responded_bestmove_) {
-        SendUciInfo();
-        if (kVerboseStats) SendMovesStats();
-        best_move_ = GetBestMoveInternal();
-        best_move_callback_({best_move_.first, best_move_.second});
-        responded_bestmove_ = true;
-        best_move_edge_ = EdgeAndNode();
+    // Taken when bestmove is sent, and written to the file after the locks are
+    // released.
+    optional<NNCache::Stats> cache_stats;
+    {
+        SharedMutex::Lock nodes_lock(nodes_mutex_);
+        Mutex::Lock lock(counters_mutex_);
+        // Don't stop when the root node is not yet expanded.
+        if (total_playouts_ == 0) return;
+        // If smart pruning tells to stop (best move found), stop.
+        if (found_best_move_) {
+            stop_ = true;
+        }
+        // Stop if reached playouts limit.
+        if (limits_.playouts >= 0 && total_playouts_ >= limits_.playouts) {
+            stop_ = true;
+        }
+        // Stop if reached visits limit.
+        if (limits_.visits >= 0 &&
+            total_playouts_ + initial_visits_ >= limits_.visits) {
+            stop_ = true;
+        }
+        // Stop if reached time limit.
+        if (limits_.time_ms >= 0 && GetTimeSinceStart() >= limits_.time_ms) {
+            stop_ = true;
+        }
+        // If we are the first to see that stop is needed.
+        if (stop_ && !responded_bestmove_) {
+            SendUciInfo();
+            if (kVerboseStats) SendMovesStats();
+            if (kTranspositions) SendTranspositionStats();
+            if (kCacheStatsInterval > 0) SendCacheStats();
+            if (!kCacheStatsFile.empty()) cache_stats = cache_->GetStats();
+            best_move_ = GetBestMoveInternal();
+            best_move_callback_({best_move_.first, best_move_.second});
+            responded_bestmove_ = true;
+            best_move_edge_ = EdgeAndNode();
+        }
+    }
+    if (cache_stats) WriteCacheStats(*cache_stats);
+}
+
+void Search::MaybePruneTree() {
+    if (kTreeMemoryLimit == 0) return;
+    if (tree_bytes_.load() < static_cast<int64_t>(kTreeMemoryLimit)) return;
+    // Only one worker prunes, others go on searching meanwhile.
+    if (tree_pruning_.exchange(true)) return;
+
+    std::vector<Node*> released;
+    {
+        SharedMutex::Lock lock(nodes_mutex_);
+        // Another worker may have pruned the tree in the meantime.
+        const size_t used = std::max<int64_t>(tree_bytes_.load(), 0);
+        // Shared nodes may have several parents, and dropping one of them
+        // would leave dangling links.
+        if (used >= kTreeMemoryLimit && !kTranspositions) {
+            const size_t target = static_cast<size_t>(
+                kTreeMemoryLimit * kTreeMemoryAfterPruning);
+            const size_t excess = used - target;
+            // Every visit adds about one node, so visits are released in
+            // proportion to memory.
+            const uint64_t visits = static_cast<uint64_t>(
+                root_node_->GetN() * static_cast<double>(excess) / used + 1);
+            PruneColdSubtrees(visits, &released);
+            if (!released.empty()) ++tree_prunes_;
+        }
+        if (used >= kTreeMemoryLimit && released.empty()) {
+            // Nothing can be released, so the tree can't grow anymore.
+            Mutex::Lock counters_lock(counters_mutex_);
+            stop_ = true;
+        }
+    }
+    // Released nodes are not reachable anymore, so they are counted off and
+    // deleted without holding the lock.
+    for (Node* node : released) {
+        AddTreeBytes(-static_cast<int64_t>(node->GetSubtreeBytes()));
+        delete node;
+    }
+    tree_pruning_ = false;
+}
+
+void Search::PruneColdSubtrees(uint64_t visits, std::vector<Node*>* released) {
+    // Children of a node hold about as many nodes as they have visits. Nodes
+    // from the root's grandchildren down are candidates, unless a playout is
+    // in progress through them. Pruning all candidates with N <= threshold,
+    // except the ones under another pruned candidate, releases children
+    // visits of candidates whose nearest candidate ancestor has
+    // N > threshold. The smallest threshold releasing enough visits is found
+    // by sweeping the events where candidates enter and leave that sum.
+    const auto is_candidate = [](const Node* node, int depth) {
+        return depth >= 2 && node->GetN() > 1 && node->HasChildren() &&
+               node->GetNInFlight() == 0;
+    };
+    struct Entry {
+        Node* node;
+        int depth;
+        // N of the nearest candidate ancestor.
+        uint32_t ancestor_n;
+    };
+    const uint32_t kNoAncestor = std::numeric_limits<uint32_t>::max();
+    // Pairs of (threshold, change of released visits from that threshold on).
+    std::vector<std::pair<uint32_t, int64_t>> events;
+    // Trees may be deep, so no recursion.
+    std::vector<Entry> to_visit = {{root_node_, 0, kNoAncestor}};
+    while (!to_visit.empty()) {
+        const Entry entry = to_visit.back();
+        to_visit.pop_back();
+        uint32_t ancestor_n = entry.ancestor_n;
+        if (is_candidate(entry.node, entry.depth)) {
+            const uint32_t n = entry.node->GetN();
+            const int64_t children_visits = entry.node->GetChildrenVisits();
+            events.emplace_back(n, children_visits);
+            if (ancestor_n != kNoAncestor) {
+                events.emplace_back(ancestor_n, -children_visits);
+            }
+            ancestor_n = n;
+        }
+        for (Node* child : entry.node->ChildNodes()) {
+            to_visit.push_back({child, entry.depth + 1, ancestor_n});
+        }
+    }
+    if (events.empty()) return;
+
+    std::sort(events.begin(), events.end());
+    uint32_t threshold = kNoAncestor;
+    int64_t released_visits = 0;
+    for (size_t i = 0; i < events.size(); ++i) {
+        released_visits += events[i].second;
+        if (i + 1 < events.size() && events[i + 1].first == events[i].first) {
+            continue;
+        }
+        if (released_visits >= static_cast<int64_t>(visits)) {
+            threshold = events[i].first;
+            break;
+        }
+    }
+
+    to_visit = {{root_node_, 0, kNoAncestor}};
+    while (!to_visit.empty()) {
+        const Entry entry = to_visit.back();
+        to_visit.pop_back();
+        if (is_candidate(entry.node, entry.depth) &&
+            entry.node->GetN() <= threshold) {
+            entry.node->PruneChildren(released);
+            continue;
+        }
+        for (Node* child : entry.node->ChildNodes()) {
+            to_visit.push_back({child, entry.depth + 1, kNoAncestor});
+        }
     }
 }
 
@@ -440,6 +734,8 @@ void Search::StartThreads(size_t how_many) {
 void Search::RunSingleThreaded() {
     SearchWorker worker(this);
     worker.RunBlocking();
+    Mutex::Lock lock(threads_mutex_);
+    UnlinkTranspositions();
 }
 
 void Search::RunBlocking(size_t threads) {
@@ -468,6 +764,7 @@ void Search::Wait() {
         threads_.back().join();
         threads_.pop_back();
     }
+    UnlinkTranspositions();
 }
 
 Search::~Search() {
@@ -502,6 +799,36 @@ void SearchWorker::ExecuteOneIteration() {
     UpdateCounters();
 }
 
+void SearchWorker::ExecutePipelinedIteration() {
+    InitializeIteration(search_->network_->NewComputation());
+    GatherMinibatch();
+    MaybePrefetchIntoCache();
+
+    // Start the NN computation and go on without waiting for it.
+    computation_->ComputeAsync();
+    pending_batches_.push_back(
+        {std::move(nodes_to_process_), std::move(computation_)});
+
+    // Finish minibatches which are ready, and the oldest one if the pipeline
+    // is full.
+    while (!pending_batches_.empty() &&
+           (static_cast<int>(pending_batches_.size()) >=
+                search_->kPipelineDepth ||
+            pending_batches_.front().computation->IsReady())) {
+        FinishPendingBatch();
+    }
+}
+
+void SearchWorker::FinishPendingBatch() {
+    nodes_to_process_ = std::move(pending_batches_.front().nodes_to_process);
+    computation_ = std::move(pending_batches_.front().computation);
+    pending_batches_.pop_front();
+    computation_->Wait();
+    FetchMinibatchResults();
+    DoBackupUpdate();
+    UpdateCounters();
+}
+
 bool SearchWorker::IsSearchActive() const {
     Mutex::Lock lock(search_->counters_mutex_);
     return !search_->stop_;
@@ -531,6 +858,9 @@ void SearchWorker::GatherMinibatch() {
         nodes_to_process_.emplace_back(PickNodeToExtend());
         auto& picked_node = nodes_to_process_.back();
         auto* node = picked_node.node;
+        picked_node.path.reserve(path_.size() + 1);
+        picked_node.path.push_back(search_->root_node_);
+        for (const auto& entry : path_) picked_node.path.push_back(entry.first);
 
         // There was a collision. If limit has been reached, return, otherwise
         // just start search of another node.
@@ -539,12 +869,17 @@ void SearchWorker::GatherMinibatch() {
             continue;
         }
         ++nodes_found;
+        if (picked_node.has_value) continue;
 
         // If node is already known as terminal (win/loss/draw according to
         // rules of the game), it means that we already visited this node
         // before.
         if (node->IsTerminal()) continue;
 
+        if (search_->kTranspositions && LinkTransposition(&picked_node)) {
+            continue;
+        }
+
         // Node was never visited, extend it.
         ExtendNode(node);
 
@@ -564,10 +899,13 @@ SearchWorker::NodeToProcess SearchWorker::PickNodeToExtend() {
 
     Node* node = search_->root_node_;
     Node::Iterator best_edge;
-    // Initialize position sequence with pre-move position.
-    history_.Trim(search_->played_history_.GetLength());
+    // Moves are collected in path_ and history_ is only rebuilt at the end.
+    path_.clear();
 
-    SharedMutex::Lock lock(search_->nodes_mutex_);
+    // Node counters are atomic and children are spawned with CAS, so workers
+    // descend concurrently. The shared lock only protects search-wide state
+    // such as best_move_edge_.
+    SharedMutex::SharedLock lock(search_->nodes_mutex_);
 
     // Fetch the current best root node visits for possible smart pruning.
     int best_node_n = search_->best_move_edge_.GetN();
@@ -583,12 +921,37 @@ SearchWorker::NodeToProcess SearchWorker::PickNodeToExtend() {
         //            in the beginning (and there would be no need for "if
         //            (!is_root_node)"), but that would mean extra mutex lock.
         //            Will revisit that after rethinking locking strategy.
-        if (!is_root_node) node = best_edge.GetOrSpawnNode(/* parent */ node);
+        if (!is_root_node) {
+            Node* parent = node;
+            bool spawned;
+            node = best_edge.GetOrSpawnNode(parent, &spawned);
+            if (spawned) search_->AddTreeBytes(sizeof(Node));
+            if (search_->kTranspositions) {
+                // Links to shared nodes may close a cycle. The position
+                // repeats then, so the playout ends with a draw.
+                bool on_path = node == search_->root_node_;
+                for (const auto& entry : path_) on_path |= entry.first == node;
+                if (on_path) {
+                    RestoreHistory();
+                    NodeToProcess result(parent, false);
+                    result.has_value = true;
+                    result.v = 0.0f;
+                    return result;
+                }
+            }
+            path_.emplace_back(node, best_edge.GetMove());
+        }
         // n_in_flight_ is incremented. If the method returns false, then there
         // is a search collision, and this node is already being expanded.
-        if (!node->TryStartScoreUpdate()) return {node, true};
+        if (!node->TryStartScoreUpdate()) {
+            RestoreHistory();
+            return {node, true};
+        }
         // Unexamined leaf node. We've hit the end of this playout.
-        if (!node->HasChildren()) return {node, false};
+        if (!node->HasChildren()) {
+            RestoreHistory();
+            return {node, false};
+        }
         // If we fall through, then n_in_flight_ has been incremented but this
         // playout remains incomplete; we must go deeper.
 
@@ -601,8 +964,31 @@ SearchWorker::NodeToProcess SearchWorker::PickNodeToExtend() {
                 ? -node->GetQ()
                 : -node->GetQ() - search_->kFpuReduction *
                                       std::sqrt(node->GetVisitedPolicy());
-        for (auto child : node->Edges()) {
-            if (is_root_node) {
+        if (!is_root_node) {
+            // Gather edge statistics into flat arrays and score them at once.
+            const int count = node->GetNumEdges();
+            const int padded =
+                (count + kPuctLanes - 1) / kPuctLanes * kPuctLanes;
+            edge_p_.resize(padded);
+            edge_n_.resize(padded);
+            edge_q_.resize(padded);
+            int i = 0;
+            for (auto child : node->Edges()) {
+                edge_p_[i] = child.GetP();
+                edge_n_[i] = child.GetNStarted();
+                edge_q_[i] = child.GetQ(parent_q);
+                ++i;
+            }
+            for (; i < padded; ++i) {
+                edge_p_[i] = 0.0f;
+                edge_n_[i] = 0.0f;
+                edge_q_[i] = -std::numeric_limits<float>::infinity();
+            }
+            const int best_idx = PuctArgmax(edge_p_.data(), edge_n_.data(),
+                                            edge_q_.data(), padded, puct_mult);
+            if (best_idx >= 0) best_edge = node->EdgeAt(best_idx);
+        } else {
+            for (auto child : node->Edges()) {
                 // If there's no chance to catch up to the current best node
                 // with remaining playouts, don't consider it. best_move_node_
                 // could have changed since best_node_n was retrieved. To ensure
@@ -623,16 +1009,15 @@ SearchWorker::NodeToProcess SearchWorker::PickNodeToExtend() {
                     continue;
                 }
                 ++possible_moves;
-            }
-            float Q = child.GetQ(parent_q);
-            const float score = child.GetU(puct_mult) + Q;
-            if (score > best) {
-                best = score;
-                best_edge = child;
+                float Q = child.GetQ(parent_q);
+                const float score = child.GetU(puct_mult) + Q;
+                if (score > best) {
+                    best = score;
+                    best_edge = child;
+                }
             }
         }
 
-        history_.Append(best_edge.GetMove());
         if (is_root_node && possible_moves <= 1 && !search_->limits_.infinite) {
             // If there is only one move theoretically possible within remaining
             // time, output it.
@@ -643,6 +1028,42 @@ SearchWorker::NodeToProcess SearchWorker::PickNodeToExtend() {
     }
 }
 
+void SearchWorker::RestoreHistory() {
+    // Shared nodes are reached by different paths, so their history can't be
+    // cached.
+    const size_t interval =
+        search_->kTranspositions ? 0 : search_->kSnapshotInterval;
+    size_t start = 0;
+    if (snapshots_tree_prunes_ != search_->tree_prunes_) {
+        // Snapshotted nodes may have been released.
+        snapshots_.clear();
+        snapshots_tree_prunes_ = search_->tree_prunes_;
+    }
+    if (interval > 0) {
+        // Look for the deepest snapshot.
+        for (size_t depth = path_.size() / interval * interval; depth > 0;
+             depth -= interval) {
+            auto iter = snapshots_.find(path_[depth - 1].first);
+            if (iter != snapshots_.end()) {
+                history_ = iter->second;
+                start = depth;
+                break;
+            }
+        }
+    }
+    if (start == 0) history_.Trim(search_->played_history_.GetLength());
+
+    const size_t cache_size = search_->kSnapshotCacheSize;
+    for (size_t depth = start + 1; depth <= path_.size(); ++depth) {
+        history_.Append(path_[depth - 1].second);
+        if (interval > 0 && cache_size > 0 && depth % interval == 0) {
+            // Memory is bounded by simply starting over when the cache is full.
+            if (snapshots_.size() >= cache_size) snapshots_.clear();
+            snapshots_.emplace(path_[depth - 1].first, history_);
+        }
+    }
+}
+
 void SearchWorker::ExtendNode(Node* node) {
     // We don't need the mutex because other threads will see that N=0 and
     // N-in-flight=1 and will not touch this node.
@@ -677,6 +1098,39 @@ void SearchWorker::ExtendNode(Node* node) {
 
     // Add legal moves as edges of this node.
     node->CreateEdges(legal_moves);
+    search_->AddTreeBytes(EdgeList::AllocatedBytes(legal_moves.size()));
+}
+
+bool SearchWorker::LinkTransposition(NodeToProcess* picked_node) {
+    auto& path = picked_node->path;
+    // Children of the root are never linked, so that the root statistics stay
+    // intact when links are removed.
+    if (path.size() <= 2) return false;
+    // Repeated positions depend on the path to them.
+    const auto& position = history_.Last();
+    if (position.GetRepetitions() > 0) return false;
+    const int no_capture_ply = position.GetNoCapturePly();
+    const uint64_t key = HashCat(
+        position.Hash(),
+        no_capture_ply < kTranspositionExactNoCapturePly ? 0 : no_capture_ply);
+
+    Node* node = picked_node->node;
+    Node* shared = search_->transpositions_.FindOrInsert(key, node);
+    // Not found, or still being extended by another playout.
+    if (shared == node || shared->GetN() == 0) return false;
+
+    auto discarded = node->GetParent()->LinkChild(node, shared);
+    search_->AddTreeBytes(-static_cast<int64_t>(discarded->GetSubtreeBytes()));
+    {
+        Mutex::Lock lock(search_->discarded_nodes_mutex_);
+        search_->discarded_nodes_.push_back(std::move(discarded));
+    }
+    // Back up the shared node's eval starting from the parent.
+    path.pop_back();
+    picked_node->node = path.back();
+    picked_node->v = -shared->GetQ();
+    picked_node->has_value = true;
+    return true;
 }
 
 // Returns whether node was already in cache.
@@ -684,7 +1138,9 @@ bool SearchWorker::AddNodeToComputation(Node* node, bool add_if_cached) {
     auto hash = history_.HashLast(search_->kCacheHistoryLength + 1);
     // If already in cache, no need to do anything.
     if (add_if_cached) {
-        if (computation_->AddInputByHash(hash)) return true;
+        if (computation_->AddInputByHash(hash, node->GetNumEdges())) {
+            return true;
+        }
     } else {
         if (search_->cache_->ContainsKey(hash)) return true;
     }
@@ -698,15 +1154,12 @@ bool SearchWorker::AddNodeToComputation(Node* node, bool add_if_cached) {
             moves.emplace_back(edge.GetMove().as_nn_index());
         }
     } else {
-        // Cache pseudolegal moves. A bit of a waste, but faster.
-        const auto& pseudolegal_moves =
-            history_.Last().GetBoard().GeneratePseudolegalMoves();
-        moves.reserve(pseudolegal_moves.size());
-        for (auto iter = pseudolegal_moves.begin(),
-                  end = pseudolegal_moves.end();
-             iter != end; ++iter) {
-            moves.emplace_back(iter->as_nn_index());
-        }
+        // Policy is cached by index of a legal move, so generate them in the
+        // same order as ExtendNode() does.
+        const auto legal_moves =
+            history_.Last().GetBoard().GenerateLegalMoves();
+        moves.reserve(legal_moves.size());
+        for (auto move : legal_moves) moves.emplace_back(move.as_nn_index());
     }
 
     computation_->AddInput(hash, std::move(planes), std::move(moves));
@@ -716,17 +1169,20 @@ bool SearchWorker::AddNodeToComputation(Node* node, bool add_if_cached) {
 // 3. Prefetch into cache.
 // ~~~~~~~~~~~~~~~~~~~~~~~
 void SearchWorker::MaybePrefetchIntoCache() {
+    const int batch_misses = computation_->GetCacheMisses();
     // TODO(mooskagh) Remove prefetch into cache if node collisions work well.
     // If there are requests to NN, but the batch is not full, try to prefetch
     // nodes which are likely useful in future.
-    if (computation_->GetCacheMisses() > 0 &&
-        computation_->GetCacheMisses() < search_->kMaxPrefetchBatch) {
+    // Prefetch walks the tree recursively and could loop on shared nodes.
+    if (!search_->kTranspositions && batch_misses > 0 &&
+        batch_misses < search_->kMaxPrefetchBatch) {
         history_.Trim(search_->played_history_.GetLength());
         SharedMutex::SharedLock lock(search_->nodes_mutex_);
-        PrefetchIntoCache(
-            search_->root_node_,
-            search_->kMaxPrefetchBatch - computation_->GetCacheMisses());
+        PrefetchIntoCache(search_->root_node_,
+                          search_->kMaxPrefetchBatch - batch_misses);
     }
+    search_->cache_->RecordBatch(computation_->GetCacheHits(), batch_misses,
+                                 computation_->GetCacheMisses() - batch_misses);
 }
 
 // Prefetches up to @budget nodes into cache. Returns number of nodes
@@ -826,6 +1282,7 @@ void SearchWorker::FetchMinibatchResults() {
     int idx_in_computation = 0;
     for (auto& node_to_process : nodes_to_process_) {
         Node* node = node_to_process.node;
+        if (node_to_process.has_value) continue;
         if (!node_to_process.nn_queried) {
             // Terminal nodes don't involve the neural NetworkComputation, nor
             // do they require any further processing after value retrieval.
@@ -835,22 +1292,23 @@ void SearchWorker::FetchMinibatchResults() {
         // For NN results, we need to populate policy as well as value.
         // First the value...
         node_to_process.v = -computation_->GetQVal(idx_in_computation);
-        // ...and secondly, the policy data.
+        // ...and secondly, the policy data. Edges store P with reduced
+        // precision, so it's normalized before being stored.
         float total = 0.0;
-        for (auto edge : node->Edges()) {
-            float p = computation_->GetPVal(idx_in_computation,
-                                            edge.GetMove().as_nn_index());
+        policy_.clear();
+        for (int i = 0; i < node->GetNumEdges(); ++i) {
+            float p = computation_->GetPVal(idx_in_computation, i);
             if (search_->kPolicySoftmaxTemp != 1.0f) {
                 p = pow(p, 1 / search_->kPolicySoftmaxTemp);
             }
             total += p;
-            edge.edge()->SetP(p);
+            policy_.push_back(p);
         }
         // Normalize P values to add up to 1.0.
-        if (total > 0.0f) {
-            float scale = 1.0f / total;
-            for (auto edge : node->Edges())
-                edge.edge()->SetP(edge.GetP() * scale);
+        if (total <= 0.0f) total = 1.0f;
+        int policy_idx = 0;
+        for (auto edge : node->Edges()) {
+            edge.edge()->SetP(policy_[policy_idx++] / total);
         }
         // Add Dirichlet noise if enabled and at root.
         if (search_->kNoise && node == search_->root_node_) {
@@ -863,16 +1321,33 @@ void SearchWorker::FetchMinibatchResults() {
 // 6. Propagate the new nodes' information to all their parents in the tree.
 // ~~~~~~~~~~~~~~
 void SearchWorker::DoBackupUpdate() {
-    // Update nodes.
+    // Node updates are atomic, other workers may select and back up at the
+    // same time.
+    int playouts = 0;
+    bool best_move_may_change = false;
+    {
+        SharedMutex::SharedLock lock(search_->nodes_mutex_);
+        best_move_may_change = BackupNodes(&playouts);
+    }
+    // Search-wide stats are updated under exclusive lock.
     SharedMutex::Lock lock(search_->nodes_mutex_);
+    if (best_move_may_change) {
+        search_->best_move_edge_ =
+            search_->GetBestChildNoTemperature(search_->root_node_);
+    }
+    search_->total_playouts_ += playouts;
+}
+
+bool SearchWorker::BackupNodes(int* playouts) {
+    // Playouts of a minibatch share their upper nodes, so updates are first
+    // summed up per node and then applied once to every node.
+    backup_updates_.clear();
     for (NodeToProcess& node_to_process : nodes_to_process_) {
-        Node* node = node_to_process.node;
+        const auto& path = node_to_process.path;
         if (node_to_process.is_collision) {
             // If it was a collision, just undo counters.
-            for (node = node->GetParent();
-                 node != search_->root_node_->GetParent();
-                 node = node->GetParent()) {
-                node->CancelScoreUpdate();
+            for (auto iter = path.rbegin() + 1; iter != path.rend(); ++iter) {
+                ++backup_updates_[*iter].cancels;
             }
             continue;
         }
@@ -881,38 +1356,53 @@ void SearchWorker::DoBackupUpdate() {
         float v = node_to_process.v;
         // Maximum depth the node is explored.
         uint16_t depth = 0;
-        // If the node is terminal, mark it as fully explored to an "infinite"
-        // depth.
-        uint16_t cur_full_depth = node->IsTerminal() ? 999 : 0;
-        bool full_depth_updated = true;
-        for (Node* n = node; n != search_->root_node_->GetParent();
-             n = n->GetParent()) {
-            ++depth;
-            n->FinalizeScoreUpdate(v);
+        for (auto iter = path.rbegin(); iter != path.rend(); ++iter) {
+            auto& update = backup_updates_[*iter];
+            ++update.visits;
+            update.v += v;
             // Q will be flipped for opponent.
             v = -v;
+            update.max_depth = std::max(update.max_depth, ++depth);
+        }
+        ++*playouts;
+    }
 
-            // Update the stats.
-            // Max depth.
-            n->UpdateMaxDepth(depth);
-            // Full depth.
-            if (full_depth_updated)
-                full_depth_updated = n->UpdateFullDepth(&cur_full_depth);
-            // Best move.
-            if (n->GetParent() == search_->root_node_ &&
-                search_->best_move_edge_.GetN() <= n->GetN()) {
-                search_->best_move_edge_ =
-                    search_->GetBestChildNoTemperature(search_->root_node_);
-            }
+    for (const auto& entry : backup_updates_) {
+        Node* node = entry.first;
+        const auto& update = entry.second;
+        if (update.visits > 0) {
+            node->FinalizeScoreUpdate(update.v, update.visits);
+            node->UpdateMaxDepth(update.max_depth);
+        }
+        if (update.cancels > 0) node->CancelScoreUpdate(update.cancels);
+    }
+
+    bool best_move_may_change = false;
+    for (NodeToProcess& node_to_process : nodes_to_process_) {
+        if (node_to_process.is_collision) continue;
+        const auto& path = node_to_process.path;
+        // Full depth. If the node is terminal, mark it as fully explored to an
+        // "infinite" depth.
+        uint16_t cur_full_depth = node_to_process.node->IsTerminal() ? 999 : 0;
+        auto iter = path.rbegin();
+        while (iter != path.rend() &&
+               (*iter)->UpdateFullDepth(&cur_full_depth)) {
+            ++iter;
+        }
+        // Best move.
+        if (path.size() >= 2 &&
+            search_->best_move_edge_.GetN() <= path[1]->GetN()) {
+            best_move_may_change = true;
         }
-        ++search_->total_playouts_;
     }
+    return best_move_may_change;
 }
 
 // 7. Update the Search's status and progress information.
 //~~~~~~~~~~~~~~~~~~~~
 void SearchWorker::UpdateCounters() {
     search_->UpdateRemainingMoves();  // Updates smart pruning counters.
+    search_->MaybePruneTree();
     search_->MaybeOutputInfo();
     search_->MaybeTriggerStop();
 
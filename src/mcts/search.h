@@ -18,9 +18,13 @@
 
 #pragma once
 
+#include <atomic>
+#include <deque>
 #include <functional>
 #include <shared_mutex>
 #include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include "chess/callbacks.h"
 #include "chess/uciloop.h"
@@ -39,7 +43,7 @@ struct SearchLimits {
     std::int64_t playouts = -1;
     std::int64_t time_ms = -1;
     bool infinite = false;
-    MoveList searchmoves;
+    std::vector<Move> searchmoves;
 };
 
 class Search {
@@ -94,6 +98,14 @@ class Search {
     static const char* kCacheHistoryLengthStr;
     static const char* kPolicySoftmaxTempStr;
     static const char* kAllowedNodeCollisionsStr;
+    static const char* kSnapshotIntervalStr;
+    static const char* kSnapshotCacheSizeStr;
+    static const char* kPipelineDepthStr;
+    static const char* kTranspositionsStr;
+    static const char* kGcThreadsStr;
+    static const char* kTreeMemoryLimitStr;
+    static const char* kCacheStatsIntervalStr;
+    static const char* kCacheStatsFileStr;
 
    private:
     // Returns the best move, maybe with temperature (according to the
@@ -111,9 +123,30 @@ class Search {
     void UpdateRemainingMoves();
     void MaybeTriggerStop();
     void MaybeOutputInfo();
+    // When this search's tree takes more memory than allowed, drops children
+    // of its least visited nodes. Stops the search if nothing can be dropped.
+    void MaybePruneTree();
+    // Accounts for tree memory allocated (or freed if negative) by the search.
+    void AddTreeBytes(int64_t bytes) {
+        if (kTreeMemoryLimit) tree_bytes_.fetch_add(bytes);
+    }
+    // Detaches children of the least visited nodes below the root's children
+    // into @released, aiming to drop @visits visits. Nodes with playouts in
+    // progress are kept. Requires exclusive nodes_mutex_.
+    void PruneColdSubtrees(uint64_t visits, std::vector<Node*>* released);
     void SendUciInfo();  // Requires nodes_mutex_ to be held.
 
     void SendMovesStats() const;
+    // Outputs how often leaves were found in the transposition table.
+    void SendTranspositionStats() const;
+    // Outputs NN cache counters.
+    void SendCacheStats() const;
+    // Overwrites the stats file with NN cache counters @stats. Shouldn't be
+    // called with locks held, so that workers don't wait for file I/O.
+    void WriteCacheStats(const NNCache::Stats& stats) const;
+    // Removes transposition links from the tree once workers are done, so
+    // that the tree can be reused and released as usual.
+    void UnlinkTranspositions() REQUIRES(threads_mutex_);
 
     // We only need first ply for debug output, but could be easily generalized.
     NNCacheLock GetCachedFirstPlyResult(EdgeAndNode) const;
@@ -129,9 +162,20 @@ class Search {
     // Stored so that in the case of non-zero temperature GetBestMove() returns
     // consistent results.
     std::pair<Move, Move> best_move_ GUARDED_BY(counters_mutex_);
+    // Time when NN cache counters were output last, in ms since start.
+    int64_t last_cache_stats_time_ GUARDED_BY(counters_mutex_) = 0;
 
     Mutex threads_mutex_;
     std::vector<std::thread> threads_ GUARDED_BY(threads_mutex_);
+    bool transpositions_unlinked_ GUARDED_BY(threads_mutex_) = false;
+
+    // Positions of leaves, to share nodes of transposed positions.
+    TranspositionTable transpositions_;
+    // Leaves replaced by links. Other workers may still hold pointers to
+    // them, so they are kept until the search ends.
+    Mutex discarded_nodes_mutex_;
+    std::vector<std::unique_ptr<Node>> discarded_nodes_
+        GUARDED_BY(discarded_nodes_mutex_);
 
     Node* root_node_;
     NNCache* cache_;
@@ -150,6 +194,15 @@ class Search {
     int64_t total_playouts_ GUARDED_BY(nodes_mutex_) = 0;
     int remaining_playouts_ GUARDED_BY(nodes_mutex_) =
         std::numeric_limits<int>::max();
+    // How many times the tree was pruned. Workers drop cached node pointers
+    // when it changes.
+    int tree_prunes_ GUARDED_BY(nodes_mutex_) = 0;
+    // Whether one of the workers is pruning the tree.
+    std::atomic<bool> tree_pruning_{false};
+    // Memory taken by the nodes and edges of this search's tree, counted only
+    // if there is a memory limit. Unlike the TreeMemoryPool total, it doesn't
+    // include old subtrees waiting for the GC or trees of other searches.
+    std::atomic<int64_t> tree_bytes_{0};
 
     BestMoveInfo::Callback best_move_callback_;
     ThinkingInfo::Callback info_callback_;
@@ -167,6 +220,15 @@ class Search {
     const bool kCacheHistoryLength;
     const float kPolicySoftmaxTemp;
     const int kAllowedNodeCollisions;
+    const int kSnapshotInterval;
+    const int kSnapshotCacheSize;
+    const int kPipelineDepth;
+    const bool kTranspositions;
+    // In bytes, 0 if there is no limit.
+    const size_t kTreeMemoryLimit;
+    // 0 if NN cache counters are not output.
+    const int kCacheStatsInterval;
+    const std::string kCacheStatsFile;
 
     friend class SearchWorker;
 };
@@ -181,6 +243,13 @@ class SearchWorker {
 
     // Runs iterations while needed.
     void RunBlocking() {
+        if (search_->kPipelineDepth > 1) {
+            while (IsSearchActive()) {
+                ExecutePipelinedIteration();
+            }
+            while (!pending_batches_.empty()) FinishPendingBatch();
+            return;
+        }
         while (IsSearchActive()) {
             ExecuteOneIteration();
         }
@@ -196,6 +265,12 @@ class SearchWorker {
     // 7. Update the Search's status and progress information.
     void ExecuteOneIteration();
 
+    // Same as ExecuteOneIteration(), but doesn't wait for the NN computation.
+    // The minibatch is kept in flight, and minibatches gathered before are
+    // finished (steps 5-7) when ready, or when kPipelineDepth of them are in
+    // flight.
+    void ExecutePipelinedIteration();
+
     // Returns whether another search iteration is needed (false means exit).
     bool IsSearchActive() const;
 
@@ -229,20 +304,74 @@ class SearchWorker {
         Node* node;
         bool is_collision = false;
         bool nn_queried = false;
+        // Whether v is already known without NN or terminal value (playout
+        // ended in a transposition or a cycle).
+        bool has_value = false;
         // Value from NN's value head, or -1/0/1 for terminal nodes.
         float v;
+        // Nodes from the root down to the node, which is the last one.
+        // Parents can't be used for backup as nodes may be shared.
+        std::vector<Node*> path;
+    };
+
+    // Minibatch whose NN computation runs while next ones are gathered.
+    struct PendingBatch {
+        std::vector<NodeToProcess> nodes_to_process;
+        std::unique_ptr<CachingComputation> computation;
+    };
+
+    // Sum of updates of one node from all playouts of a minibatch.
+    struct BackupUpdate {
+        // Completed playouts through the node, and sum of their values.
+        int visits = 0;
+        float v = 0.0f;
+        // Collided playouts through the node.
+        int cancels = 0;
+        // Deepest playout below the node, counting the node itself.
+        uint16_t max_depth = 0;
     };
 
+    // Waits for the oldest pending minibatch and backs it up.
+    void FinishPendingBatch();
     NodeToProcess PickNodeToExtend();
+    // Backs up values of nodes_to_process_ to the root, counting completed
+    // playouts. Returns whether the best root move may have changed.
+    bool BackupNodes(int* playouts);
+    // Brings history_ to the end of path_, starting from the deepest
+    // snapshot on the path.
+    void RestoreHistory();
     void ExtendNode(Node* node);
+    // In transpositions mode, looks for an evaluated node of the same position
+    // as the new leaf. If there is one, the leaf's edge is linked to it and its
+    // Q is backed up instead of extending the leaf. Otherwise the leaf is
+    // registered for later playouts. Returns whether the leaf was linked.
+    bool LinkTransposition(NodeToProcess* picked_node);
     bool AddNodeToComputation(Node* node, bool add_if_cached = true);
     int PrefetchIntoCache(Node* node, int budget);
 
     Search* const search_;
     std::vector<NodeToProcess> nodes_to_process_;
     std::unique_ptr<CachingComputation> computation_;
+    // Minibatches being computed, oldest first.
+    std::deque<PendingBatch> pending_batches_;
     // History is reset and extended by PickNodeToExtend().
     PositionHistory history_;
+    // Per-edge P, N-started and Q of the node being descended, gathered for
+    // PuctArgmax(). Padded to a multiple of kPuctLanes.
+    std::vector<float> edge_p_;
+    std::vector<float> edge_n_;
+    std::vector<float> edge_q_;
+    // Policy of the node being filled in by FetchMinibatchResults().
+    std::vector<float> policy_;
+    // Updates of the minibatch being backed up, by node.
+    std::unordered_map<Node*, BackupUpdate> backup_updates_;
+    // Nodes of the current playout below the root, with moves leading to them.
+    std::vector<std::pair<Node*, Move>> path_;
+    // Histories of nodes at every kSnapshotInterval-th ply below the root.
+    // Node pointers stay valid until the tree is pruned.
+    std::unordered_map<Node*, PositionHistory> snapshots_;
+    // Search::tree_prunes_ when snapshots_ were started.
+    int snapshots_tree_prunes_ = 0;
 };
 
 }  // namespace cczero
@@ -15,12 +15,292 @@
   You should have received a copy of the GNU General Public License
   along with Chinese Chess Zero.  If not, see <http://www.gnu.org/licenses/>.
 */
+#include <algorithm>
 #include <cassert>
 #include <iostream>
+#include <sstream>
 
 #include "neural/cache.h"
+#include "utils/probability.h"
 
 namespace cczero {
+
+void NNEvalTable::Insert(uint64_t key, float q,
+                         const std::vector<float>& probs) {
+    if (num_buckets_ == 0 || probs.size() > kMaxMoves) return;
+    const size_t bucket_idx = GetBucket(key);
+    Bucket& bucket = buckets_[bucket_idx];
+    Stripe& stripe = GetStripe(bucket_idx);
+    Mutex::Lock lock(stripe.mutex);
+
+    int slot = -1;
+    for (int i = 0; i < kWays; ++i) {
+        if (bucket.states[i] == kEmpty) {
+            if (slot == -1) slot = i;
+        } else if (bucket.keys[i] == key) {
+            bucket.states[i] = kReferenced;
+            return;
+        }
+    }
+    if (slot == -1) {
+        // Two rounds are enough to clear all referenced slots.
+        for (int i = 0; i < 2 * kWays; ++i) {
+            const int idx = bucket.hand;
+            bucket.hand = (bucket.hand + 1) % kWays;
+            if (bucket.pins[idx] > 0) continue;
+            if (bucket.states[idx] == kReferenced) {
+                bucket.states[idx] = kUsed;
+                continue;
+            }
+            slot = idx;
+            break;
+        }
+        // All slots are pinned.
+        if (slot == -1) {
+            ++stripe.stats.pinned_evictions;
+            return;
+        }
+        ++stripe.stats.evictions;
+    } else {
+        ++size_;
+    }
+    ++stripe.stats.inserts;
+
+    bucket.keys[slot] = key;
+    bucket.states[slot] = kUsed;
+    Entry& entry = entries_[bucket_idx * kWays + slot];
+    entry.q = q;
+    entry.num_moves = probs.size();
+    for (size_t i = 0; i < probs.size(); ++i) {
+        entry.probs[i] = CompressProbability(std::min(probs[i], 1.0f));
+    }
+}
+
+bool NNEvalTable::ContainsKey(uint64_t key) {
+    if (num_buckets_ == 0) return false;
+    const size_t bucket_idx = GetBucket(key);
+    const Bucket& bucket = buckets_[bucket_idx];
+    Mutex::Lock lock(GetStripe(bucket_idx).mutex);
+    for (int i = 0; i < kWays; ++i) {
+        if (bucket.states[i] != kEmpty && bucket.keys[i] == key) return true;
+    }
+    return false;
+}
+
+const NNEvalTable::Entry* NNEvalTable::LookupAndPin(uint64_t key,
+                                                     bool count_lookup) {
+    if (num_buckets_ == 0) return nullptr;
+    const size_t bucket_idx = GetBucket(key);
+    Bucket& bucket = buckets_[bucket_idx];
+    Stripe& stripe = GetStripe(bucket_idx);
+    Mutex::Lock lock(stripe.mutex);
+    if (count_lookup) ++stripe.stats.lookups;
+    for (int i = 0; i < kWays; ++i) {
+        if (bucket.states[i] != kEmpty && bucket.keys[i] == key) {
+            if (count_lookup) ++stripe.stats.hits;
+            bucket.states[i] = kReferenced;
+            ++bucket.pins[i];
+            return &entries_[bucket_idx * kWays + i];
+        }
+    }
+    return nullptr;
+}
+
+void NNEvalTable::Unpin(const Entry* entry) {
+    const size_t idx = entry - entries_.get();
+    const size_t bucket_idx = idx / kWays;
+    Mutex::Lock lock(GetStripe(bucket_idx).mutex);
+    assert(buckets_[bucket_idx].pins[idx % kWays] > 0);
+    --buckets_[bucket_idx].pins[idx % kWays];
+}
+
+void NNEvalTable::SetCapacity(int capacity) {
+    num_buckets_ = (std::max(capacity, 0) + kWays - 1) / kWays;
+    capacity_ = num_buckets_ * kWays;
+    size_ = 0;
+    // Buckets start empty. Entries are left uninitialized, so that their
+    // memory is only touched when the table fills up.
+    buckets_.reset(num_buckets_ ? new Bucket[num_buckets_]() : nullptr);
+    entries_.reset(capacity_ ? new Entry[capacity_] : nullptr);
+}
+
+void NNEvalTable::Clear() {
+    for (size_t bucket_idx = 0; bucket_idx < num_buckets_; ++bucket_idx) {
+        Bucket& bucket = buckets_[bucket_idx];
+        Mutex::Lock lock(GetStripe(bucket_idx).mutex);
+        for (int i = 0; i < kWays; ++i) {
+            if (bucket.states[i] == kEmpty || bucket.pins[i] > 0) continue;
+            bucket.states[i] = kEmpty;
+            --size_;
+        }
+    }
+}
+
+CacheStats NNEvalTable::GetStats() const {
+    CacheStats stats;
+    for (const auto& stripe : stripes_) {
+        Mutex::Lock lock(stripe.mutex);
+        stats += stripe.stats;
+    }
+    return stats;
+}
+
+void NNCache::Insert(uint64_t key, float q, const std::vector<float>& probs) {
+    InsertInMemory(key, q, probs);
+    if (file_) file_->Insert(key, q, probs);
+}
+
+void NNCache::InsertInMemory(uint64_t key, float q,
+                             const std::vector<float>& probs) {
+    if (use_table_) {
+        table_.Insert(key, q, probs);
+        return;
+    }
+    auto req = std::make_unique<CachedNNRequest>(probs.size());
+    req->q = q;
+    for (size_t i = 0; i < probs.size(); ++i) {
+        req->p[i] = CompressProbability(std::min(probs[i], 1.0f));
+    }
+    lru_.Insert(key, std::move(req));
+}
+
+bool NNCache::ContainsKey(uint64_t key) {
+    if (use_table_ ? table_.ContainsKey(key) : lru_.ContainsKey(key)) {
+        return true;
+    }
+    return file_ && file_->ContainsKey(key);
+}
+
+void NNCache::SetCapacity(int capacity) {
+    capacity_ = capacity;
+    if (use_table_) {
+        table_.SetCapacity(capacity);
+    } else {
+        lru_.SetCapacity(capacity);
+    }
+}
+
+void NNCache::SetUseTable(bool use_table) {
+    if (use_table == use_table_) return;
+    use_table_ = use_table;
+    if (use_table_) {
+        lru_.SetCapacity(0);
+        table_.SetCapacity(capacity_);
+    } else {
+        table_.SetCapacity(0);
+        lru_.SetCapacity(capacity_);
+    }
+}
+
+void NNCache::Clear() {
+    if (use_table_) {
+        table_.Clear();
+    } else {
+        lru_.Clear();
+    }
+}
+
+int NNCache::GetSize() const {
+    return use_table_ ? table_.GetSize() : lru_.GetSize();
+}
+
+void NNCache::RecordBatch(int hits, int misses, int prefetches) {
+    batch_hits_.fetch_add(hits, std::memory_order_relaxed);
+    batch_misses_.fetch_add(misses, std::memory_order_relaxed);
+    prefetches_.fetch_add(prefetches, std::memory_order_relaxed);
+}
+
+NNCache::Stats NNCache::GetStats() const {
+    Stats stats;
+    stats.size = GetSize();
+    stats.capacity = capacity_;
+    stats.memory = use_table_ ? table_.GetStats() : lru_.GetStats();
+    stats.file_lookups = file_lookups_.load(std::memory_order_relaxed);
+    stats.file_hits = file_hits_.load(std::memory_order_relaxed);
+    stats.batch_hits = batch_hits_.load(std::memory_order_relaxed);
+    stats.batch_misses = batch_misses_.load(std::memory_order_relaxed);
+    stats.prefetches = prefetches_.load(std::memory_order_relaxed);
+    return stats;
+}
+
+NNCache::Stats& NNCache::Stats::operator+=(const Stats& other) {
+    size += other.size;
+    capacity += other.capacity;
+    memory += other.memory;
+    file_lookups += other.file_lookups;
+    file_hits += other.file_hits;
+    batch_hits += other.batch_hits;
+    batch_misses += other.batch_misses;
+    prefetches += other.prefetches;
+    return *this;
+}
+
+std::string FormatCacheStats(const NNCache::Stats& stats) {
+    std::ostringstream oss;
+    oss << "size " << stats.size << " capacity " << stats.capacity
+        << " lookups " << stats.memory.lookups << " hits "
+        << stats.memory.hits << " inserts " << stats.memory.inserts
+        << " evictions " << stats.memory.evictions << " pinned_evictions "
+        << stats.memory.pinned_evictions << " file_lookups "
+        << stats.file_lookups << " file_hits " << stats.file_hits
+        << " batch_hits " << stats.batch_hits << " batch_misses "
+        << stats.batch_misses << " prefetches " << stats.prefetches;
+    return oss.str();
+}
+
+NNCacheLock::NNCacheLock(NNCache* cache, uint64_t key)
+    : cache_(cache), key_(key) {
+    Pin();
+    if (*this || !cache_->file_) return;
+    // Bring the evaluation from the file into memory.
+    float q;
+    std::vector<float> probs;
+    cache_->file_lookups_.fetch_add(1, std::memory_order_relaxed);
+    if (!cache_->file_->Lookup(key, &q, &probs)) return;
+    cache_->InsertInMemory(key, q, probs);
+    Pin(false);
+    // Insert does nothing when all slots of the bucket are pinned, and the
+    // entry may be evicted again before it is pinned.
+    if (*this) cache_->file_hits_.fetch_add(1, std::memory_order_relaxed);
+}
+
+NNCacheLock& NNCacheLock::operator=(NNCacheLock&& other) {
+    Unpin();
+    cache_ = other.cache_;
+    key_ = other.key_;
+    request_ = other.request_;
+    entry_ = other.entry_;
+    other.request_ = nullptr;
+    other.entry_ = nullptr;
+    return *this;
+}
+
+void NNCacheLock::Pin(bool count_lookup) {
+    if (cache_->use_table_) {
+        entry_ = cache_->table_.LookupAndPin(key_, count_lookup);
+    } else {
+        request_ = cache_->lru_.LookupAndPin(key_, count_lookup);
+    }
+}
+
+void NNCacheLock::Unpin() {
+    if (request_) cache_->lru_.Unpin(key_, request_);
+    if (entry_) cache_->table_.Unpin(entry_);
+    request_ = nullptr;
+    entry_ = nullptr;
+}
+
+float NNCacheLock::GetQ() const { return entry_ ? entry_->q : request_->q; }
+
+int NNCacheLock::GetNumMoves() const {
+    return entry_ ? entry_->num_moves : request_->p.size();
+}
+
+float NNCacheLock::GetP(int move_idx) const {
+    assert(move_idx >= 0 && move_idx < GetNumMoves());
+    if (entry_) return DecompressProbability(entry_->probs[move_idx]);
+    return DecompressProbability(request_->p[move_idx]);
+}
 CachingComputation::CachingComputation(
     std::unique_ptr<NetworkComputation> parent, NNCache* cache)
     : parent_(std::move(parent)), cache_(cache) {}
@@ -31,9 +311,12 @@ int CachingComputation::GetCacheMisses() const {
 
 int CachingComputation::GetBatchSize() const { return batch_.size(); }
 
-bool CachingComputation::AddInputByHash(uint64_t hash) {
+bool CachingComputation::AddInputByHash(uint64_t hash, int num_moves) {
     NNCacheLock lock(cache_, hash);
-    if (!lock) return false;
+    // Priors are read by move index, so an entry of another position must not
+    // be used.
+    if (!lock || lock.GetNumMoves() != num_moves) return false;
+    ++cache_hits_;
     batch_.emplace_back();
     batch_.back().lock = std::move(lock);
     batch_.back().hash = hash;
@@ -43,7 +326,7 @@ bool CachingComputation::AddInputByHash(uint64_t hash) {
 void CachingComputation::AddInput(
     uint64_t hash, InputPlanes&& input,
     std::vector<uint16_t>&& probabilities_to_cache) {
-    if (AddInputByHash(hash)) return;
+    if (AddInputByHash(hash, probabilities_to_cache.size())) return;
     batch_.emplace_back();
     batch_.back().hash = hash;
     batch_.back().idx_in_parent = parent_->GetBatchSize();
@@ -55,49 +338,56 @@ void CachingComputation::PopLastInputHit() {
     assert(!batch_.empty());
     assert(batch_.back().idx_in_parent == -1);
     batch_.pop_back();
+    --cache_hits_;
 }
 
 void CachingComputation::ComputeBlocking() {
     if (parent_->GetBatchSize() == 0) return;
     parent_->ComputeBlocking();
+    PopulateCache();
+}
 
+void CachingComputation::ComputeAsync() {
+    if (parent_->GetBatchSize() == 0) return;
+    parent_->ComputeAsync();
+}
+
+bool CachingComputation::IsReady() const {
+    if (parent_->GetBatchSize() == 0) return true;
+    return parent_->IsReady();
+}
+
+void CachingComputation::Wait() {
+    if (parent_->GetBatchSize() == 0) return;
+    parent_->Wait();
+    PopulateCache();
+}
+
+void CachingComputation::PopulateCache() {
     // Fill cache with data from NN.
     for (const auto& item : batch_) {
         if (item.idx_in_parent == -1) continue;
-        auto req = std::make_unique<CachedNNRequest>(
-            item.probabilities_to_cache.size());
-        req->q = parent_->GetQVal(item.idx_in_parent);
-        int idx = 0;
+        probs_.clear();
         for (auto x : item.probabilities_to_cache) {
-            req->p[idx++] =
-                std::make_pair(x, parent_->GetPVal(item.idx_in_parent, x));
+            probs_.push_back(parent_->GetPVal(item.idx_in_parent, x));
         }
-        cache_->Insert(item.hash, std::move(req));
+        cache_->Insert(item.hash, parent_->GetQVal(item.idx_in_parent), probs_);
     }
 }
 
 float CachingComputation::GetQVal(int sample) const {
     const auto& item = batch_[sample];
     if (item.idx_in_parent >= 0) return parent_->GetQVal(item.idx_in_parent);
-    return item.lock->q;
+    return item.lock.GetQ();
 }
 
-float CachingComputation::GetPVal(int sample, int move_id) const {
-    auto& item = batch_[sample];
-    if (item.idx_in_parent >= 0)
-        return parent_->GetPVal(item.idx_in_parent, move_id);
-    const auto& moves = item.lock->p;
-
-    int total_count = 0;
-    while (total_count < moves.size()) {
-        // Optimization: usually moves are stored in the same order as queried.
-        const auto& move = moves[item.last_idx++];
-        if (item.last_idx == moves.size()) item.last_idx = 0;
-        if (move.first == move_id) return move.second;
-        ++total_count;
+float CachingComputation::GetPVal(int sample, int move_idx) const {
+    const auto& item = batch_[sample];
+    if (item.idx_in_parent >= 0) {
+        return parent_->GetPVal(item.idx_in_parent,
+                                item.probabilities_to_cache[move_idx]);
     }
-    assert(false);  // Move not found.
-    return 0;
+    return item.lock.GetP(move_idx);
 }
 
 }  // namespace cczero
@@ -17,22 +17,214 @@
 */
 #pragma once
 
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "neural/cachefile.h"
 #include "neural/network.h"
 #include "utils/cache.h"
+#include "utils/mutex.h"
 #include "utils/smallarray.h"
 
 namespace cczero {
 
 struct CachedNNRequest {
     CachedNNRequest(size_t size) : p(size) {}
-    typedef std::pair<uint16_t, float> IdxAndProb;
     float q;
-    // TODO(mooskagh) Don't really need index if using perfect hash.
-    SmallArray<IdxAndProb> p;
+    // Probabilities of legal moves in the order they are generated, compressed
+    // with CompressProbability(). Moves themselves are not stored.
+    SmallArray<uint16_t> p;
+};
+
+// Preallocated open addressing table of NN evaluations. Q and policy are
+// stored inline in fixed size entries, so inserts don't allocate memory.
+// A key may only be stored in kWays slots of its bucket, whose keys are kept
+// together, apart from entries. When all of them are taken, CLOCK chooses the
+// slot to replace: a slot which was used since the bucket's hand passed it
+// last time gets another round. Pinned slots are never replaced.
+// Thread safe, except SetCapacity().
+class NNEvalTable {
+   public:
+    // Positions with more legal moves are not stored. Same limit as the file,
+    // so that whatever is read from it can be kept in memory.
+    static const int kMaxMoves = NNCacheFile::kMaxMoves;
+
+    struct Entry {
+        float q;
+        uint8_t num_moves;
+        // Same as CachedNNRequest::p.
+        uint16_t probs[kMaxMoves];
+    };
+
+    NNEvalTable(int capacity = 0) { SetCapacity(capacity); }
+
+    // Stores evaluation of a position: value @q and probabilities @probs of
+    // its legal moves. Does nothing if the key is already there, the position
+    // has too many moves, or all slots of the bucket are pinned.
+    void Insert(uint64_t key, float q, const std::vector<float>& probs);
+    // Checks whether a key exists. Doesn't count as a use of the entry.
+    bool ContainsKey(uint64_t key);
+    // Looks up and pins the entry by key. Returns nullptr if not found.
+    // Found entry has to be unpinned with Unpin() when no longer needed.
+    // If @count_lookup is false, the call is left out of lookup counters.
+    const Entry* LookupAndPin(uint64_t key, bool count_lookup = true);
+    void Unpin(const Entry* entry);
+
+    // Reallocates the table for @capacity entries, rounded up to a whole
+    // bucket. All entries are dropped, so none may be pinned.
+    void SetCapacity(int capacity);
+    // Drops all entries which are not pinned.
+    void Clear();
+    int GetSize() const { return size_; }
+    int GetCapacity() const { return capacity_; }
+    CacheStats GetStats() const;
+
+   private:
+    static const int kWays = 4;
+    static const int kStripes = 256;
+
+    enum SlotState : uint8_t { kEmpty, kUsed, kReferenced };
+
+    struct Bucket {
+        uint64_t keys[kWays];
+        uint16_t pins[kWays];
+        SlotState states[kWays];
+        // Slot to consider for replacement next.
+        uint8_t hand;
+    };
+
+    size_t GetBucket(uint64_t key) const { return key % num_buckets_; }
+    struct Stripe {
+        mutable Mutex mutex;
+        CacheStats stats GUARDED_BY(mutex);
+    };
+    Stripe& GetStripe(size_t bucket) { return stripes_[bucket % kStripes]; }
+
+    // Bucket i is guarded by stripes_[i % kStripes].mutex, as are its entries
+    // [i * kWays, (i + 1) * kWays). Counters of operations on the bucket are
+    // kept in the same stripe.
+    std::unique_ptr<Bucket[]> buckets_;
+    std::unique_ptr<Entry[]> entries_;
+    size_t num_buckets_ = 0;
+    int capacity_ = 0;
+    std::atomic<int> size_{0};
+    Stripe stripes_[kStripes];
+};
+
+// Cache of NN evaluations by position hash. Keeps them either in a sharded
+// LRU cache or in NNEvalTable, optionally backed by NNCacheFile. Thread safe,
+// except SetShards(), SetUseTable() and SetFile().
+class NNCache {
+   public:
+    struct Stats {
+        int size = 0;
+        int capacity = 0;
+        // Of the LRU cache or the table, whichever is used. Reset when it
+        // changes, or when LRU cache shards change.
+        CacheStats memory;
+        // Lookups which missed in memory and went to the file, and those of
+        // them which were found there and brought into memory.
+        uint64_t file_lookups = 0;
+        uint64_t file_hits = 0;
+        // Positions which search needed evaluated for its minibatches, and
+        // positions which prefetch evaluated in advance.
+        uint64_t batch_hits = 0;
+        uint64_t batch_misses = 0;
+        uint64_t prefetches = 0;
+
+        Stats& operator+=(const Stats& other);
+    };
+
+    NNCache(int capacity = 128, int shards = 1)
+        : capacity_(capacity), lru_(capacity, shards) {}
+
+    // Stores evaluation of a position: value @q and probabilities @probs of
+    // its legal moves, in the order they are generated. Goes to the file too.
+    void Insert(uint64_t key, float q, const std::vector<float>& probs);
+    // Checks whether a key exists in memory or in the file. Of course, the
+    // next moment the key may be evicted.
+    bool ContainsKey(uint64_t key);
+
+    // Sets the number of evaluations to keep. The table is reallocated and
+    // loses its entries, so with it none may be pinned.
+    void SetCapacity(int capacity);
+    // Sets the number of LRU cache shards. Entries are dropped, so none may be
+    // pinned.
+    void SetShards(int shards) { lru_.SetShards(shards); }
+    // Switches between LRU cache and the fixed slot table. Entries are
+    // dropped, so none may be pinned.
+    void SetUseTable(bool use_table);
+    // Sets the file where evaluations missing in memory are looked up, and new
+    // ones are stored. nullptr for none.
+    void SetFile(std::unique_ptr<NNCacheFile> file) { file_ = std::move(file); }
+    // Drops all entries which are not pinned.
+    void Clear();
+    int GetSize() const;
+    int GetCapacity() const { return capacity_; }
+
+    // Records how search used the cache for a minibatch.
+    void RecordBatch(int hits, int misses, int prefetches);
+    Stats GetStats() const;
+
+   private:
+    friend class NNCacheLock;
+
+    void InsertInMemory(uint64_t key, float q, const std::vector<float>& probs);
+
+    std::atomic<int> capacity_;
+    bool use_table_ = false;
+    // Only the one in use has nonzero capacity.
+    ShardedLruCache<uint64_t, CachedNNRequest> lru_;
+    NNEvalTable table_;
+    std::unique_ptr<NNCacheFile> file_;
+
+    std::atomic<uint64_t> file_lookups_{0};
+    std::atomic<uint64_t> file_hits_{0};
+    std::atomic<uint64_t> batch_hits_{0};
+    std::atomic<uint64_t> batch_misses_{0};
+    std::atomic<uint64_t> prefetches_{0};
 };
 
-typedef LruCache<uint64_t, CachedNNRequest> NNCache;
-typedef LruCacheLock<uint64_t, CachedNNRequest> NNCacheLock;
+// Formats @stats as space separated names and values, for both people and
+// scripts to read.
+std::string FormatCacheStats(const NNCache::Stats& stats);
+
+// Looks up an evaluation in NNCache and keeps it pinned while the lock lives.
+class NNCacheLock {
+   public:
+    NNCacheLock() {}
+    NNCacheLock(NNCache* cache, uint64_t key);
+    NNCacheLock(NNCacheLock&& other) { *this = std::move(other); }
+    NNCacheLock& operator=(NNCacheLock&& other);
+    NNCacheLock(const NNCacheLock&) = delete;
+    ~NNCacheLock() { Unpin(); }
+
+    // Returns whether the evaluation was found.
+    operator bool() const { return request_ || entry_; }
+
+    float GetQ() const;
+    // Number of legal moves the evaluation has probabilities for.
+    int GetNumMoves() const;
+    // Returns probability of legal move number @move_idx, which must be less
+    // than GetNumMoves().
+    float GetP(int move_idx) const;
+
+   private:
+    // Looks up the key in memory and pins it if found. @count_lookup is false
+    // to pin an evaluation just brought from the file, which is the same
+    // lookup.
+    void Pin(bool count_lookup = true);
+    void Unpin();
+
+    NNCache* cache_ = nullptr;
+    uint64_t key_ = 0;
+    // Set if found in LRU cache.
+    CachedNNRequest* request_ = nullptr;
+    // Set if found in table.
+    const NNEvalTable::Entry* entry_ = nullptr;
+};
 
 // Wraps around NetworkComputation and caches result.
 // While it mostly repeats NetworkComputation interface, it's not derived
@@ -45,14 +237,18 @@ class CachingComputation {
     // How many inputs are not found in cache and will be forwarded to a wrapped
     // computation.
     int GetCacheMisses() const;
+    // How many inputs were found in cache.
+    int GetCacheHits() const { return cache_hits_; }
     // Total number of times AddInput/AddInputByHash were (successfully) called.
     int GetBatchSize() const;
-    // Adds input by hash only. If that hash is not in cache, returns false
-    // and does nothing. Otherwise adds.
-    bool AddInputByHash(uint64_t hash);
+    // Adds input by hash only. If that hash is not in cache, or the cached
+    // evaluation is not for @num_moves legal moves (a hash collision), returns
+    // false and does nothing. Otherwise adds.
+    bool AddInputByHash(uint64_t hash, int num_moves);
     // Adds a sample to the batch.
     // @hash is a hash to store/lookup it in the cache.
-    // @probabilities_to_cache is which indices of policy head to store.
+    // @probabilities_to_cache is which indices of policy head to store. They
+    // must be legal moves of the position, in the order they are generated.
     void AddInput(uint64_t hash, InputPlanes&& input,
                   std::vector<uint16_t>&& probabilities_to_cache);
     // Undos last AddInput. If it was a cache miss, the it's actually not
@@ -60,23 +256,35 @@ class CachingComputation {
     void PopLastInputHit();
     // Do the computation.
     void ComputeBlocking();
+    // Starts the computation without waiting for it. See NetworkComputation.
+    void ComputeAsync();
+    // Returns whether Wait() would return immediately.
+    bool IsReady() const;
+    // Waits for the computation started by ComputeAsync() to finish, and
+    // fills the cache.
+    void Wait();
     // Returns Q value of @sample.
     float GetQVal(int sample) const;
-    // Returns P value @move_id of @sample.
-    float GetPVal(int sample, int move_id) const;
+    // Returns P value of legal move number @move_idx of @sample.
+    float GetPVal(int sample, int move_idx) const;
 
    private:
+    // Stores results of the wrapped computation into cache.
+    void PopulateCache();
+
     struct WorkItem {
         uint64_t hash;
         NNCacheLock lock;
         int idx_in_parent = -1;
         std::vector<uint16_t> probabilities_to_cache;
-        mutable int last_idx = 0;
     };
 
     std::unique_ptr<NetworkComputation> parent_;
     NNCache* cache_;
     std::vector<WorkItem> batch_;
+    int cache_hits_ = 0;
+    // Scratch space for policy of a sample, reused between samples.
+    std::vector<float> probs_;
 };
 
 }  // namespace cczero
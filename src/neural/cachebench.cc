@@ -0,0 +1,112 @@
+/*
+  This file is part of Chinese Chess Zero.
+  Copyright (C) 2018 The CCZero Authors
+
+  Chinese Chess Zero is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Chinese Chess Zero is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Chinese Chess Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "neural/cache.h"
+#include "neural/cachebench.h"
+#include "utils/hashcat.h"
+
+namespace cczero {
+
+namespace {
+const char* kMaxThreadsStr = "Largest number of threads to run with";
+const char* kCacheSizeStr = "NNCache size";
+const char* kCacheShardsStr = "NNCache shards";
+const char* kCacheBackendStr = "NNCache backend";
+const char* kPositionsStr = "Number of distinct positions";
+const char* kMovesStr = "Legal moves per position";
+const char* kLookupsStr = "Lookups per thread";
+}  // namespace
+
+void CacheBenchLoop::RunLoop() {
+    options_.Add<IntOption>(kMaxThreadsStr, 1, 1024, "threads", 't') = 64;
+    options_.Add<IntOption>(kCacheSizeStr, 1, 999999999, "nncache") = 200000;
+    options_.Add<IntOption>(kCacheShardsStr, 1, 256, "nncache-shards") = 16;
+    options_.Add<ChoiceOption>(kCacheBackendStr,
+                               std::vector<std::string>{"lru", "table"},
+                               "nncache-backend") = "lru";
+    options_.Add<IntOption>(kPositionsStr, 1, 999999999, "positions") =
+        400000;
+    options_.Add<IntOption>(kMovesStr, 1, NNEvalTable::kMaxMoves, "moves") =
+        40;
+    options_.Add<IntOption>(kLookupsStr, 1, 999999999, "lookups") = 200000;
+
+    if (!options_.ProcessAllFlags()) return;
+    const auto& options = options_.GetOptionsDict();
+    const int max_threads = options.Get<int>(kMaxThreadsStr);
+    const int positions = options.Get<int>(kPositionsStr);
+    const int lookups = options.Get<int>(kLookupsStr);
+    const std::vector<float> probs(options.Get<int>(kMovesStr), 0.01f);
+
+    // Thread counts double up to the largest one, which is run as well.
+    std::vector<int> thread_counts;
+    for (int threads = 1; threads < max_threads; threads *= 2) {
+        thread_counts.push_back(threads);
+    }
+    thread_counts.push_back(max_threads);
+
+    for (const int threads : thread_counts) {
+        // Every run starts with an empty cache.
+        NNCache cache(options.Get<int>(kCacheSizeStr),
+                      options.Get<int>(kCacheShardsStr));
+        cache.SetUseTable(options.Get<std::string>(kCacheBackendStr) ==
+                          "table");
+
+        const auto start = std::chrono::steady_clock::now();
+        auto worker = [&](int seed) {
+            std::mt19937 random(seed);
+            std::uniform_int_distribution<int> position(0, positions - 1);
+            float sum = 0.0f;
+            for (int i = 0; i < lookups; ++i) {
+                const uint64_t key = Hash(position(random));
+                {
+                    NNCacheLock lock(&cache, key);
+                    if (lock) {
+                        sum += lock.GetQ() + lock.GetP(probs.size() - 1);
+                        continue;
+                    }
+                }
+                cache.Insert(key, 0.0f, probs);
+            }
+            // Keeps the reads from being optimized away.
+            if (sum < 0.0f) std::cerr << sum << std::endl;
+        };
+        std::vector<std::thread> workers;
+        for (int i = 1; i < threads; ++i) workers.emplace_back(worker, i);
+        worker(0);
+        for (auto& thread : workers) thread.join();
+
+        const std::int64_t time_us =
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start)
+                .count();
+        const std::int64_t total = static_cast<std::int64_t>(threads) * lookups;
+        const std::int64_t lps = time_us ? total * 1000000 / time_us : 0;
+        std::cout << "threads " << threads << " lookups " << total << " time "
+                  << time_us / 1000 << " lps " << lps << " "
+                  << FormatCacheStats(cache.GetStats()) << std::endl;
+    }
+}
+
+}  // namespace cczero
@@ -0,0 +1,36 @@
+/*
+  This file is part of Chinese Chess Zero.
+  Copyright (C) 2018 The CCZero Authors
+
+  Chinese Chess Zero is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Chinese Chess Zero is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Chinese Chess Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "utils/optionsparser.h"
+
+namespace cczero {
+
+// NN cache benchmark mode: many threads look up evaluations of random
+// positions and insert the ones which are missing, the way search workers do.
+// Shows how throughput scales with threads for a given number of shards.
+class CacheBenchLoop {
+   public:
+    void RunLoop();
+
+   private:
+    OptionsParser options_;
+};
+
+}  // namespace cczero
@@ -0,0 +1,180 @@
+/*
+  This file is part of Chinese Chess Zero.
+  Copyright (C) 2018 The CCZero Authors
+
+  Chinese Chess Zero is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Chinese Chess Zero is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Chinese Chess Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <cstring>
+
+#include "chess/board.h"
+#include "neural/cachefile.h"
+#include "utils/exception.h"
+#include "utils/filesystem.h"
+#include "utils/hashcat.h"
+#include "utils/probability.h"
+
+namespace cczero {
+
+namespace {
+// Low six bytes read "CC0NNC" in a little endian file.
+const uint64_t kMagic = 0x434e4e304343ULL;
+const uint64_t kMagicMask = 0xffffffffffffULL;
+// Must be bumped whenever Slot or Header layout changes.
+const uint64_t kFormatVersion = 2;
+// High two bytes are the versions of the layout and of the legal move order.
+const uint64_t kVersionedMagic =
+    kMagic | kFormatVersion << 48 |
+    static_cast<uint64_t>(ChessBoard::kMoveOrderVersion) << 56;
+
+bool IsWritten(uint32_t sequence) { return sequence % 2 == 0; }
+}  // namespace
+
+// Other processes may use different locks for the same address.
+static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2,
+              "Atomics in a shared file must be lock free");
+
+NNCacheFile::NNCacheFile(const std::string& filename, int capacity,
+                         uint64_t network_hash)
+    : size_(sizeof(Header) +
+            (std::max(capacity, 1) + kWays - 1) / kWays * kWays *
+                sizeof(Slot)),
+      network_hash_(network_hash) {
+    data_ = MapFile(filename, &size_);
+    auto* header = static_cast<Header*>(data_);
+    // New file is filled with zeros.
+    uint64_t magic = 0;
+    if (size_ < sizeof(Header) + kWays * sizeof(Slot) ||
+        (!header->magic.compare_exchange_strong(magic, kVersionedMagic) &&
+         (magic & kMagicMask) != kMagic)) {
+        UnmapFile(data_, size_);
+        throw Exception("Not an NN cache file: " + filename);
+    }
+    if (magic != 0 && magic != kVersionedMagic) {
+        UnmapFile(data_, size_);
+        throw Exception("NN cache file " + filename +
+                        " was written by an incompatible version, delete it");
+    }
+    slots_ = reinterpret_cast<Slot*>(header + 1);
+    num_buckets_ = (size_ - sizeof(Header)) / (kWays * sizeof(Slot));
+}
+
+NNCacheFile::~NNCacheFile() { UnmapFile(data_, size_); }
+
+void NNCacheFile::Insert(uint64_t key, float q,
+                         const std::vector<float>& probs) {
+    if (probs.size() > kMaxMoves) return;
+    const uint64_t file_key = GetFileKey(key);
+    Slot* bucket = GetBucket(file_key);
+    // Slots with odd sequence are being written, or were left by a killed
+    // writer, so they are neither reused nor count as holding their key.
+    bool written[kWays];
+    Slot* slot = nullptr;
+    for (int i = 0; i < kWays; ++i) {
+        written[i] =
+            IsWritten(bucket[i].sequence.load(std::memory_order_relaxed));
+        if (!written[i]) continue;
+        const uint64_t slot_key = bucket[i].key.load(std::memory_order_relaxed);
+        if (slot_key == file_key) return;
+        if (slot_key == 0 && !slot) slot = &bucket[i];
+    }
+    if (!slot) {
+        // All slots are taken. Low bits of the key chose the bucket, so use
+        // high ones to choose the slot to overwrite.
+        const int first = (file_key >> 32) % kWays;
+        for (int i = 0; i < kWays && !slot; ++i) {
+            const int idx = (first + i) % kWays;
+            if (written[idx]) slot = &bucket[idx];
+        }
+        if (!slot) return;
+    }
+
+    uint32_t sequence = slot->sequence.load(std::memory_order_relaxed);
+    if (!IsWritten(sequence) ||
+        !slot->sequence.compare_exchange_strong(sequence, sequence + 1,
+                                                std::memory_order_relaxed)) {
+        return;
+    }
+    // Readers which see any of the writes below also see odd sequence.
+    std::atomic_thread_fence(std::memory_order_release);
+    uint32_t q_bits;
+    std::memcpy(&q_bits, &q, sizeof(q_bits));
+    slot->key.store(file_key, std::memory_order_relaxed);
+    slot->num_moves.store(probs.size(), std::memory_order_relaxed);
+    slot->q.store(q_bits, std::memory_order_relaxed);
+    for (size_t i = 0; i < probs.size(); i += 2) {
+        uint32_t word = CompressProbability(std::min(probs[i], 1.0f));
+        if (i + 1 < probs.size()) {
+            const uint32_t high =
+                CompressProbability(std::min(probs[i + 1], 1.0f));
+            word |= high << 16;
+        }
+        slot->probs[i / 2].store(word, std::memory_order_relaxed);
+    }
+    slot->sequence.store(sequence + 2, std::memory_order_release);
+}
+
+bool NNCacheFile::ContainsKey(uint64_t key) const {
+    const uint64_t file_key = GetFileKey(key);
+    const Slot* bucket = GetBucket(file_key);
+    for (int i = 0; i < kWays; ++i) {
+        if (IsWritten(bucket[i].sequence.load(std::memory_order_relaxed)) &&
+            bucket[i].key.load(std::memory_order_relaxed) == file_key) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool NNCacheFile::Lookup(uint64_t key, float* q,
+                         std::vector<float>* probs) const {
+    const uint64_t file_key = GetFileKey(key);
+    const Slot* bucket = GetBucket(file_key);
+    for (int i = 0; i < kWays; ++i) {
+        const Slot& slot = bucket[i];
+        const uint32_t sequence = slot.sequence.load(std::memory_order_acquire);
+        if (!IsWritten(sequence)) continue;
+        if (slot.key.load(std::memory_order_relaxed) != file_key) continue;
+        const uint32_t num_moves =
+            std::min<uint32_t>(slot.num_moves.load(std::memory_order_relaxed),
+                               kMaxMoves);
+        const uint32_t q_bits = slot.q.load(std::memory_order_relaxed);
+        probs->resize(num_moves);
+        for (uint32_t j = 0; j < num_moves; ++j) {
+            const uint32_t word =
+                slot.probs[j / 2].load(std::memory_order_relaxed);
+            (*probs)[j] = DecompressProbability(j % 2 ? word >> 16 : word);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        // The slot was overwritten while being read.
+        if (slot.sequence.load(std::memory_order_relaxed) != sequence) {
+            return false;
+        }
+        std::memcpy(q, &q_bits, sizeof(*q));
+        return true;
+    }
+    return false;
+}
+
+uint64_t NNCacheFile::GetFileKey(uint64_t key) const {
+    const uint64_t file_key = HashCat(key, network_hash_);
+    return file_key == 0 ? 1 : file_key;
+}
+
+NNCacheFile::Slot* NNCacheFile::GetBucket(uint64_t file_key) const {
+    return slots_ + file_key % num_buckets_ * kWays;
+}
+
+}  // namespace cczero
@@ -0,0 +1,94 @@
+/*
+  This file is part of Chinese Chess Zero.
+  Copyright (C) 2018 The CCZero Authors
+
+  Chinese Chess Zero is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Chinese Chess Zero is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Chinese Chess Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace cczero {
+
+// NN evaluations stored in a memory mapped file, so that they survive restarts
+// and are shared by all processes which open the same file. Works like
+// NNEvalTable without CLOCK: a key may be stored in kWays slots of its bucket,
+// and when all of them are taken, one of them is overwritten. Slots are
+// published with a sequence number, which is odd while a slot is being
+// written, so readers never see a half written evaluation. A process killed
+// during a write leaves its slot odd, and the slot is lost until the file is
+// deleted; other slots of the bucket keep working.
+// Keys are combined with the network hash, so one file can be used with
+// different networks. Policy is stored in the order of generated legal moves,
+// so files written with another move order or slot layout are refused.
+class NNCacheFile {
+   public:
+    // Positions with more legal moves are not stored.
+    static const int kMaxMoves = 118;
+
+    // Opens @filename, creating it with room for @capacity evaluations if it
+    // doesn't exist. An existing file keeps its size. Throws exception if
+    // cannot, or if the file was written by an incompatible version.
+    NNCacheFile(const std::string& filename, int capacity,
+                uint64_t network_hash);
+    ~NNCacheFile();
+    NNCacheFile(const NNCacheFile&) = delete;
+
+    // Stores evaluation of a position: value @q and probabilities @probs of
+    // its legal moves. Does nothing if the key is already there, the position
+    // has too many moves, or every slot it could take is being written.
+    void Insert(uint64_t key, float q, const std::vector<float>& probs);
+    // Checks whether a key exists.
+    bool ContainsKey(uint64_t key) const;
+    // Reads evaluation of @key into @q and @probs. Returns false if not found.
+    bool Lookup(uint64_t key, float* q, std::vector<float>* probs) const;
+
+    int GetCapacity() const { return num_buckets_ * kWays; }
+
+   private:
+    static const int kWays = 4;
+
+    // Words are atomic, as they are read and written by several processes.
+    struct Slot {
+        std::atomic<uint32_t> sequence;
+        std::atomic<uint32_t> num_moves;
+        // 0 for empty slot.
+        std::atomic<uint64_t> key;
+        // Bits of float.
+        std::atomic<uint32_t> q;
+        // Compressed probabilities, two per word.
+        std::atomic<uint32_t> probs[kMaxMoves / 2];
+    };
+
+    struct Header {
+        // File type and version, set at once when the file is created.
+        std::atomic<uint64_t> magic;
+        char reserved[sizeof(Slot) - sizeof(magic)];
+    };
+
+    uint64_t GetFileKey(uint64_t key) const;
+    Slot* GetBucket(uint64_t file_key) const;
+
+    void* data_;
+    uint64_t size_;
+    Slot* slots_;
+    uint64_t num_buckets_;
+    const uint64_t network_hash_;
+};
+
+}  // namespace cczero
@@ -54,8 +54,8 @@ InputPlanes EncodePositionForNN(const PositionHistory& history,
          ++i, flip = !flip, --history_idx) {
         if (history_idx < 0) break;
         const Position& position = history.GetPositionAt(history_idx);
-        const ChessBoard& board =
-            flip ? position.GetThemBoard() : position.GetBoard();
+        ChessBoard board = position.GetBoard();
+        if (flip) board.Mirror();
 
         const int base = i * kPlanesPerBoard;
         result[base + 0].mask = (board.ours() * board.pawns()).as_int();
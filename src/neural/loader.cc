@@ -19,6 +19,7 @@
 #include <algorithm>
 #include <cctype>
 #include <cstdio>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <sstream>
@@ -28,6 +29,7 @@
 #include "utils/commandline.h"
 #include "utils/exception.h"
 #include "utils/filesystem.h"
+#include "utils/hashcat.h"
 #include "version.inc"
 
 namespace cczero {
@@ -70,6 +72,17 @@ std::string DecompressGzip(const std::string& filename) {
     return buffer;
 }
 
+uint64_t HashBuffer(const std::string& buffer) {
+    uint64_t hash = buffer.size();
+    for (size_t i = 0; i < buffer.size(); i += sizeof(uint64_t)) {
+        uint64_t x = 0;
+        std::memcpy(&x, &buffer[i],
+                    std::min(sizeof(uint64_t), buffer.size() - i));
+        hash = HashCat(hash, x);
+    }
+    return hash;
+}
+
 FloatVector DenormLayer(const pbcczero::Weights_Layer& layer) {
     FloatVector vec;
     auto& buffer = layer.params();
@@ -163,6 +176,7 @@ FloatVectors LoadFloatsFromFile(std::string* buffer) {
 Weights LoadWeightsFromFile(const std::string& filename) {
     FloatVectors vecs;
     auto buffer = DecompressGzip(filename);
+    const uint64_t hash = HashBuffer(buffer);
 
     if (buffer.size() < 2)
         throw Exception("Weight file invalid");
@@ -197,6 +211,7 @@ Weights LoadWeightsFromFile(const std::string& filename) {
     }
 
     PopulateConvBlockWeights(&vecs, &result.input);
+    result.hash = hash;
     return result;
 }
 
@@ -18,6 +18,8 @@
 
 #pragma once
 
+#include <chrono>
+#include <future>
 #include <memory>
 #include <vector>
 
@@ -56,6 +58,9 @@ struct Weights {
     Vec ip1_val_b;
     Vec ip2_val_w;
     Vec ip2_val_b;
+
+    // Hash of the weights file contents, tells networks apart.
+    uint64_t hash = 0;
 };
 
 // All input planes are 64 value vectors, every element of which is either
@@ -80,6 +85,25 @@ class NetworkComputation {
     virtual void AddInput(InputPlanes&& input) = 0;
     // Do the computation.
     virtual void ComputeBlocking() = 0;
+    // Starts the computation and returns immediately. Results may only be
+    // read after Wait() returns. Backends without a native asynchronous mode
+    // run ComputeBlocking() on a helper thread. If the computation was started
+    // this way, Wait() has to be called before destroying it.
+    virtual void ComputeAsync() {
+        pending_ =
+            std::async(std::launch::async, [this]() { ComputeBlocking(); });
+    }
+    // Returns whether the computation started by ComputeAsync() has finished,
+    // so that Wait() won't block.
+    virtual bool IsReady() const {
+        return !pending_.valid() ||
+               pending_.wait_for(std::chrono::seconds(0)) ==
+                   std::future_status::ready;
+    }
+    // Blocks until the computation started by ComputeAsync() finishes.
+    virtual void Wait() {
+        if (pending_.valid()) pending_.get();
+    }
     // Returns how many times AddInput() was called.
     virtual int GetBatchSize() const = 0;
     // Returns Q value of @sample.
@@ -87,6 +111,9 @@ class NetworkComputation {
     // Returns P value @move_id of @sample.
     virtual float GetPVal(int sample, int move_id) const = 0;
     virtual ~NetworkComputation() {}
+
+   private:
+    std::future<void> pending_;
 };
 
 class Network {
@@ -122,6 +122,7 @@ void SelfPlayLoop::SendTournament(const TournamentInfo& info) {
            std::to_string(info.results[2][1]);
     res += " draw " + std::to_string(info.results[1][0]) + " " +
            std::to_string(info.results[1][1]);
+    if (!info.cache_stats.empty()) res += " nncache " + info.cache_stats;
     SendResponse(res);
 }
 
@@ -32,6 +32,10 @@ const char* kTotalGamesStr = "Number of games to play";
 const char* kParallelGamesStr = "Number of games to play in parallel";
 const char* kThreadsStr = "Number of CPU threads for every game";
 const char* kNnCacheSizeStr = "NNCache size";
+const char* kNnCacheShardsStr = "NNCache shards";
+const char* kNnCacheBackendStr = "NNCache backend";
+const char* kNnCacheFileStr = "NNCache file";
+const char* kNnCacheFileSizeStr = "NNCache file size";
 const char* kNetFileStr = "Network weights file path";
 const char* kPlayoutsStr = "Number of playouts per move to search";
 const char* kVisitsStr = "Number of visits per move to search";
@@ -46,6 +50,21 @@ const char* kResignPlaythroughStr =
 // Value for network autodiscover.
 const char* kAutoDiscover = "<autodiscover>";
 
+// Creates NNCache as set in player's @options.
+std::shared_ptr<NNCache> MakeCache(const OptionsDict& options,
+                                   uint64_t network_hash) {
+    auto cache = std::make_shared<NNCache>(options.Get<int>(kNnCacheSizeStr),
+                                           options.Get<int>(kNnCacheShardsStr));
+    cache->SetUseTable(options.Get<std::string>(kNnCacheBackendStr) ==
+                       "table");
+    const auto filename = options.Get<std::string>(kNnCacheFileStr);
+    if (!filename.empty()) {
+        cache->SetFile(std::make_unique<NNCacheFile>(
+            filename, options.Get<int>(kNnCacheFileSizeStr), network_hash));
+    }
+    return cache;
+}
+
 }  // namespace
 
 void SelfPlayTournament::PopulateOptions(OptionsParser* options) {
@@ -57,6 +76,13 @@ void SelfPlayTournament::PopulateOptions(OptionsParser* options) {
     options->Add<IntOption>(kParallelGamesStr, 1, 256, "parallelism") = 8;
     options->Add<IntOption>(kThreadsStr, 1, 8, "threads", 't') = 1;
     options->Add<IntOption>(kNnCacheSizeStr, 0, 999999999, "nncache") = 200000;
+    options->Add<IntOption>(kNnCacheShardsStr, 1, 256, "nncache-shards") = 16;
+    options->Add<ChoiceOption>(kNnCacheBackendStr,
+                               std::vector<std::string>{"lru", "table"},
+                               "nncache-backend") = "lru";
+    options->Add<StringOption>(kNnCacheFileStr, "nncache-file");
+    options->Add<IntOption>(kNnCacheFileSizeStr, 1, 999999999,
+                            "nncache-file-size") = 1000000;
     options->Add<StringOption>(kNetFileStr, "weights", 'w') = kAutoDiscover;
     options->Add<IntOption>(kPlayoutsStr, -1, 999999999, "playouts", 'p') = -1;
     options->Add<IntOption>(kVisitsStr, -1, 999999999, "visits", 'v') = -1;
@@ -106,6 +132,7 @@ SelfPlayTournament::SelfPlayTournament(const OptionsDict& options,
     }
 
     static const char* kPlayerNames[2] = {"player1", "player2"};
+    uint64_t network_hashes[2] = {};
     // Initializing networks.
     for (int idx : {0, 1}) {
         // If two players have the same network, no need to load two.
@@ -123,6 +150,7 @@ SelfPlayTournament::SelfPlayTournament(const OptionsDict& options,
             }
             if (network_identical) {
                 networks_[1] = networks_[0];
+                network_hashes[1] = network_hashes[0];
                 break;
             }
         }
@@ -133,6 +161,7 @@ SelfPlayTournament::SelfPlayTournament(const OptionsDict& options,
             path = DiscoveryWeightsFile();
         }
         Weights weights = LoadWeightsFromFile(path);
+        network_hashes[idx] = weights.hash;
         std::string backend = options.GetSubdict(kPlayerNames[idx])
                                   .Get<std::string>(kNnBackendStr);
         std::string backend_options =
@@ -147,13 +176,11 @@ SelfPlayTournament::SelfPlayTournament(const OptionsDict& options,
     }
 
     // Initializing cache.
-    cache_[0] = std::make_shared<NNCache>(
-        options.GetSubdict("player1").Get<int>(kNnCacheSizeStr));
+    cache_[0] = MakeCache(options.GetSubdict("player1"), network_hashes[0]);
     if (kShareTree) {
         cache_[1] = cache_[0];
     } else {
-        cache_[1] = std::make_shared<NNCache>(
-            options.GetSubdict("player2").Get<int>(kNnCacheSizeStr));
+        cache_[1] = MakeCache(options.GetSubdict("player2"), network_hashes[1]);
     }
 
     // SearchLimits.
@@ -278,6 +305,7 @@ void SelfPlayTournament::PlayOneGame(int game_number) {
                     : game.GetGameResult() == GameResult::WHITE_WON ? 0 : 2;
             if (player1_black) result = 2 - result;
             ++tournament_info_.results[result][player1_black ? 1 : 0];
+            tournament_info_.cache_stats = GetCacheStats();
             tournament_callback_(tournament_info_);
         }
     }
@@ -288,6 +316,12 @@ void SelfPlayTournament::PlayOneGame(int game_number) {
     }
 }
 
+std::string SelfPlayTournament::GetCacheStats() const {
+    auto stats = cache_[0]->GetStats();
+    if (cache_[1] != cache_[0]) stats += cache_[1]->GetStats();
+    return FormatCacheStats(stats);
+}
+
 void SelfPlayTournament::Worker() {
     // Play games while game limit is not reached (or while not aborted).
     while (true) {
@@ -316,6 +350,7 @@ void SelfPlayTournament::RunBlocking() {
         Mutex::Lock lock(mutex_);
         if (!abort_) {
             tournament_info_.finished = true;
+            tournament_info_.cache_stats = GetCacheStats();
             tournament_callback_(tournament_info_);
         }
     } else {
@@ -336,6 +371,7 @@ void SelfPlayTournament::Wait() {
         Mutex::Lock lock(mutex_);
         if (!abort_) {
             tournament_info_.finished = true;
+            tournament_info_.cache_stats = GetCacheStats();
             tournament_callback_(tournament_info_);
         }
     }
@@ -57,6 +57,8 @@ class SelfPlayTournament {
    private:
     void Worker();
     void PlayOneGame(int game_id);
+    // Returns NN cache counters of both players together.
+    std::string GetCacheStats() const;
 
     Mutex mutex_;
     // Whether next game will be black for player1.
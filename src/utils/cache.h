@@ -18,14 +18,38 @@
 
 #pragma once
 
+#include <atomic>
 #include <cassert>
 #include <cstring>
 #include <memory>
 #include <string>
+#include <vector>
+#include "utils/hashcat.h"
 #include "utils/mutex.h"
 
 namespace cczero {
 
+// Usage counters of a cache.
+struct CacheStats {
+    uint64_t lookups = 0;
+    uint64_t hits = 0;
+    uint64_t inserts = 0;
+    // Elements evicted to make room for new ones.
+    uint64_t evictions = 0;
+    // Evictions which met pinned elements. LruCache keeps such elements until
+    // they are unpinned, NNEvalTable skips the insert instead.
+    uint64_t pinned_evictions = 0;
+
+    CacheStats& operator+=(const CacheStats& other) {
+        lookups += other.lookups;
+        hits += other.hits;
+        inserts += other.inserts;
+        evictions += other.evictions;
+        pinned_evictions += other.pinned_evictions;
+        return *this;
+    }
+};
+
 // Generic LRU cache. Thread-safe. Takes ownership of all values, which are
 // deleted upon eviction; thus, using values stored requires pinning them, which
 // in turn requires Unpin()ing them after use. The use of LruCacheLock is
@@ -64,7 +88,10 @@ class LruCache {
             }
         }
 
+        const int old_size = size_;
         ShrinkToCapacity(capacity_ - 1);
+        stats_.evictions += old_size - size_;
+        ++stats_.inserts;
         ++size_;
         ++allocated_;
         Item* new_item = new Item(key, std::move(val), pinned ? 1 : 0);
@@ -89,13 +116,17 @@ class LruCache {
     // If found, brings the element to the head of the queue (makes it last to
     // evict); furthermore, a call to Unpin must be made for each such element.
     // Use of LruCacheLock is recommended to automate this pin management.
-    V* LookupAndPin(K key) {
+    // If @count_lookup is false, the call is left out of lookup counters, e.g.
+    // to pin an element which was just inserted.
+    V* LookupAndPin(K key, bool count_lookup = true) {
         Mutex::Lock lock(mutex_);
+        if (count_lookup) ++stats_.lookups;
 
         auto hash = hasher_(key) % hash_.size();
         for (Item* iter = hash_[hash]; iter; iter = iter->next_in_hash) {
             if (key == iter->key) {
                 // BringToFront(iter);
+                if (count_lookup) ++stats_.hits;
                 ++iter->pins;
                 return iter->value.get();
             }
@@ -108,7 +139,17 @@ class LruCache {
     void Unpin(K key, V* value) {
         Mutex::Lock lock(mutex_);
 
-        // Checking evicted list first.
+        // Pinned elements are rarely evicted, so look in active list first.
+        auto hash = hasher_(key) % hash_.size();
+        for (Item* iter = hash_[hash]; iter; iter = iter->next_in_hash) {
+            if (key == iter->key && value == iter->value.get()) {
+                assert(iter->pins > 0);
+                --iter->pins;
+                return;
+            }
+        }
+
+        // Now check evicted list.
         Item** cur = &evicted_head_;
         for (Item* el = evicted_head_; el; el = el->next_in_hash) {
             if (key == el->key && value == el->value.get()) {
@@ -121,16 +162,6 @@ class LruCache {
             }
             cur = &el->next_in_hash;
         }
-
-        // Now lookup in active list.
-        auto hash = hasher_(key) % hash_.size();
-        for (Item* iter = hash_[hash]; iter; iter = iter->next_in_hash) {
-            if (key == iter->key && value == iter->value.get()) {
-                assert(iter->pins > 0);
-                --iter->pins;
-                return;
-            }
-        }
         assert(false);
     }
 
@@ -150,11 +181,13 @@ class LruCache {
 
         if (size_ != 0) {
             for (Item* head : hash_) {
-                for (Item* iter = head; head; head = head->next_in_hash) {
+                for (Item* iter = head; iter;) {
+                    Item* next = iter->next_in_hash;
                     auto& new_hash_head =
                         new_hash[hasher_(iter->key) % new_hash.size()];
                     iter->next_in_hash = new_hash_head;
                     new_hash_head = iter;
+                    iter = next;
                 }
             }
         }
@@ -175,6 +208,10 @@ class LruCache {
         Mutex::Lock lock(mutex_);
         return capacity_;
     }
+    CacheStats GetStats() const {
+        Mutex::Lock lock(mutex_);
+        return stats_;
+    }
 
    private:
     struct Item {
@@ -212,6 +249,7 @@ class LruCache {
                     --allocated_;
                     delete el;
                 } else {
+                    ++stats_.pinned_evictions;
                     el->next_in_hash = evicted_head_;
                     evicted_head_ = el;
                 }
@@ -268,16 +306,88 @@ class LruCache {
         nullptr;  // Evicted but pinned elements.
     std::vector<Item*> hash_ GUARDED_BY(mutex_);
     std::hash<K> hasher_ GUARDED_BY(mutex_);
+    CacheStats stats_ GUARDED_BY(mutex_);
 
     mutable Mutex mutex_;
 };
 
-// Convenience class for pinning cache items.
+// LRU cache split into shards, each one being an LruCache with its own lock
+// and an equal part of the capacity. Shard is selected by key, so threads
+// mostly don't wait for each other. Elements are evicted in LRU order within
+// a shard. Thread-safe, except SetShards().
 template <class K, class V>
+class ShardedLruCache {
+   public:
+    ShardedLruCache(int capacity = 128, int shards = 1) : capacity_(capacity) {
+        SetShards(shards);
+    }
+
+    // See LruCache for the meaning of these.
+    V* Insert(K key, std::unique_ptr<V> val, bool pinned = false) {
+        return GetShard(key).Insert(key, std::move(val), pinned);
+    }
+    bool ContainsKey(K key) { return GetShard(key).ContainsKey(key); }
+    V* LookupAndPin(K key, bool count_lookup = true) {
+        return GetShard(key).LookupAndPin(key, count_lookup);
+    }
+    void Unpin(K key, V* value) { GetShard(key).Unpin(key, value); }
+
+    // Sets the total capacity of the cache.
+    void SetCapacity(int capacity) {
+        capacity_ = capacity;
+        for (auto& shard : shards_) shard->SetCapacity(GetShardCapacity());
+    }
+
+    // Sets the number of shards. Elements are dropped when it changes, so
+    // none may be pinned, and the cache may not be used meanwhile.
+    void SetShards(int shards) {
+        if (shards < 1) shards = 1;
+        if (static_cast<int>(shards_.size()) == shards) return;
+        shards_.clear();
+        for (int i = 0; i < shards; ++i) {
+            shards_.emplace_back(new LruCache<K, V>(GetShardCapacity(shards)));
+        }
+    }
+
+    void Clear() {
+        for (auto& shard : shards_) shard->Clear();
+    }
+
+    int GetSize() const {
+        int size = 0;
+        for (const auto& shard : shards_) size += shard->GetSize();
+        return size;
+    }
+    int GetCapacity() const { return capacity_; }
+    // Counters are kept per shard, and are reset by SetShards().
+    CacheStats GetStats() const {
+        CacheStats stats;
+        for (const auto& shard : shards_) stats += shard->GetStats();
+        return stats;
+    }
+
+   private:
+    int GetShardCapacity(int shards) const {
+        return (capacity_ + shards - 1) / shards;
+    }
+    int GetShardCapacity() const { return GetShardCapacity(shards_.size()); }
+
+    LruCache<K, V>& GetShard(K key) {
+        // Keys are scrambled, as shards' hash tables use low bits of hash.
+        return *shards_[Hash(hasher_(key)) % shards_.size()];
+    }
+
+    std::atomic<int> capacity_;
+    std::vector<std::unique_ptr<LruCache<K, V>>> shards_;
+    std::hash<K> hasher_;
+};
+
+// Convenience class for pinning cache items.
+template <class K, class V, class Cache = LruCache<K, V>>
 class LruCacheLock {
    public:
     // Looks up the value in @cache by @key and pins it if found.
-    LruCacheLock(LruCache<K, V>* cache, K key)
+    LruCacheLock(Cache* cache, K key)
         : cache_(cache), key_(key), value_(cache->LookupAndPin(key_)) {}
 
     // Unpins the cache entry (if holds).
@@ -307,7 +417,7 @@ class LruCacheLock {
     }
 
    private:
-    LruCache<K, V>* cache_ = nullptr;
+    Cache* cache_ = nullptr;
     K key_;
     V* value_ = nullptr;
 };
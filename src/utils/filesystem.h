@@ -38,4 +38,12 @@ uint64_t GetFileSize(const std::string& filename);
 // Returns modification time of a file. Throws exception if file doesn't exist.
 time_t GetFileTime(const std::string& filename);
 
+// Maps a file into memory for reading and writing, shared with all processes
+// which map it. A missing or empty file is created with size @*size, otherwise
+// @*size is set to the size of the file. Throws exception if cannot.
+void* MapFile(const std::string& filename, uint64_t* size);
+
+// Unmaps memory returned by MapFile().
+void UnmapFile(void* data, uint64_t size);
+
 }  // namespace cczero
@@ -21,7 +21,10 @@
 
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 namespace cczero {
 
@@ -75,4 +78,31 @@ time_t GetFileTime(const std::string& filename) {
 #endif
 }
 
+void* MapFile(const std::string& filename, uint64_t* size) {
+    const int fd = open(filename.c_str(), O_RDWR | O_CREAT, 0666);
+    if (fd < 0) throw Exception("Cannot open file: " + filename);
+    struct stat s;
+    if (fstat(fd, &s) == 0 && s.st_size == 0) {
+        // Extends the file by writing its last byte rather than ftruncate(),
+        // which could shrink it if another process has just created it larger.
+        const char zero = 0;
+        if (pwrite(fd, &zero, 1, *size - 1) != 1) {
+            close(fd);
+            throw Exception("Cannot resize file: " + filename);
+        }
+    }
+    if (fstat(fd, &s) < 0) {
+        close(fd);
+        throw Exception("Cannot stat file: " + filename);
+    }
+    *size = s.st_size;
+    void* data =
+        mmap(nullptr, *size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) throw Exception("Cannot map file: " + filename);
+    return data;
+}
+
+void UnmapFile(void* data, uint64_t size) { munmap(data, size); }
+
 }  // namespace cczero
@@ -62,4 +62,30 @@ time_t GetFileTime(const std::string& filename) {
            s.ftLastWriteTime.dwLowDateTime;
 }
 
+void* MapFile(const std::string& filename, uint64_t* size) {
+    HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ | GENERIC_WRITE,
+                              FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+                              OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        throw Exception("Cannot open file: " + filename);
+    }
+    LARGE_INTEGER file_size;
+    if (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0) {
+        *size = file_size.QuadPart;
+    }
+    // Mapping a file larger than it is extends it.
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE,
+                                        static_cast<DWORD>(*size >> 32),
+                                        static_cast<DWORD>(*size), nullptr);
+    CloseHandle(file);
+    if (!mapping) throw Exception("Cannot map file: " + filename);
+    // The view keeps the mapping alive.
+    void* data = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, *size);
+    CloseHandle(mapping);
+    if (!data) throw Exception("Cannot map file: " + filename);
+    return data;
+}
+
+void UnmapFile(void* data, uint64_t /* size */) { UnmapViewOfFile(data); }
+
 }  // namespace cczero
\ No newline at end of file
@@ -61,6 +61,8 @@ class CAPABILITY("mutex") Mutex {
        public:
         Lock(Mutex& m) ACQUIRE(m) : lock_(m.get_raw()) {}
         ~Lock() RELEASE() {}
+        // For waiting on a std::condition_variable.
+        std::unique_lock<std::mutex>& get_raw() { return lock_; }
 
        private:
         std::unique_lock<std::mutex> lock_;
@@ -0,0 +1,50 @@
+/*
+  This file is part of Chinese Chess Zero.
+  Copyright (C) 2018 The CCZero Authors
+
+  Chinese Chess Zero is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Chinese Chess Zero is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Chinese Chess Zero.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+
+namespace cczero {
+
+// Probabilities are stored in 16 bits as bits 12..27 of a float, whose
+// exponent is then in [-31, 0]. That keeps about 3.5 significant digits, and
+// values below 2^-31 become (almost) zero.
+
+// Compresses @p, which has to be in [0, 1].
+inline uint16_t CompressProbability(float p) {
+    assert(0.0f <= p && p <= 1.0f);
+    // Rounds the mantissa and drops the implied exponent bits.
+    constexpr int32_t kRounding = (1 << 11) - (3 << 28);
+    int32_t bits;
+    std::memcpy(&bits, &p, sizeof(bits));
+    bits += kRounding;
+    return bits < 0 ? 0 : static_cast<uint16_t>(bits >> 12);
+}
+
+inline float DecompressProbability(uint16_t compressed) {
+    // Shift back into place and set the exponent bits which are implied.
+    const uint32_t bits = (static_cast<uint32_t>(compressed) << 12) | (3 << 28);
+    float p;
+    std::memcpy(&p, &bits, sizeof(p));
+    return p;
+}
+
+}  // namespace cczero